@@ -0,0 +1,22 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <cstdint>
+#include <string>
+
+struct LoadOptions {
+  int port = 3100;
+  // run against an already running server instead of spawning one
+  bool external = false;
+  int clients = 50;
+  int pipeline = 1;
+  uint64_t keys = 10000;
+  size_t value_size = 16;
+  int duration = 10;
+  std::string mix = "get:80,set:20";
+};
+
+int run_load(const LoadOptions &options);
+int run_micro(const std::string &filter);
+
+#endif
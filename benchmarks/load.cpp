@@ -0,0 +1,327 @@
+#include "bench.hpp"
+#include "latency_histogram.hpp"
+#include "server.hpp"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// appends one newline terminated command for `key` to `out`
+using CommandGen =
+    std::function<void(std::string &out, uint64_t key, const std::string &)>;
+
+static const std::unordered_map<std::string, CommandGen> generators{
+    {"set",
+     [](std::string &out, uint64_t key, const std::string &value) {
+       out += "SET key:" + std::to_string(key) + " " + value + "\n";
+     }},
+    {"get",
+     [](std::string &out, uint64_t key, const std::string &) {
+       out += "GET key:" + std::to_string(key) + "\n";
+     }},
+    {"del",
+     [](std::string &out, uint64_t key, const std::string &) {
+       out += "DEL key:" + std::to_string(key) + "\n";
+     }},
+    {"incr",
+     [](std::string &out, uint64_t key, const std::string &) {
+       out += "INCR counter:" + std::to_string(key) + "\n";
+     }},
+    {"hset",
+     [](std::string &out, uint64_t key, const std::string &value) {
+       out += "HSET hash:" + std::to_string(key) + " field " + value + "\n";
+     }},
+    {"hget",
+     [](std::string &out, uint64_t key, const std::string &) {
+       out += "HGET hash:" + std::to_string(key) + " field\n";
+     }},
+    {"ladd",
+     [](std::string &out, uint64_t key, const std::string &value) {
+       out += "LADD list:" + std::to_string(key) + " " + value + "\n";
+     }},
+    {"lget",
+     [](std::string &out, uint64_t key, const std::string &) {
+       out += "LGET list:" + std::to_string(key) + " 0\n";
+     }},
+};
+
+struct MixEntry {
+  const CommandGen *gen;
+  uint32_t cumulative_weight;
+};
+
+static bool parse_mix(const std::string &mix, std::vector<MixEntry> &entries) {
+  uint32_t total = 0;
+  size_t start = 0;
+  while (start < mix.size()) {
+    size_t end = mix.find(',', start);
+    if (end == std::string::npos) {
+      end = mix.size();
+    }
+    std::string item = mix.substr(start, end - start);
+    start = end + 1;
+
+    size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    uint32_t weight = 1;
+    if (colon != std::string::npos) {
+      weight = std::strtoul(item.c_str() + colon + 1, nullptr, 10);
+    }
+    auto it = generators.find(name);
+    if (it == generators.end() || weight == 0) {
+      std::cerr << "unknown command in mix: " << item << std::endl;
+      return false;
+    }
+    total += weight;
+    entries.push_back({&it->second, total});
+  }
+  return !entries.empty();
+}
+
+static int connect_loopback(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static bool send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto n = send(fd, data.data() + sent, data.size() - sent, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// every reply is a single line, so counting newlines is enough.
+class ReplyReader {
+public:
+  explicit ReplyReader(int fd) : fd_(fd) {}
+
+  template <typename F> bool read_replies(int amount, F on_reply) {
+    while (amount > 0) {
+      if (pos_ == len_) {
+        auto n = recv(fd_, buffer_, sizeof(buffer_), 0);
+        if (n <= 0) {
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          return false;
+        }
+        pos_ = 0;
+        len_ = n;
+      }
+      while (pos_ < len_ && amount > 0) {
+        if (buffer_[pos_++] == '\n') {
+          on_reply();
+          --amount;
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  int fd_;
+  char buffer_[64 * 1024];
+  size_t pos_ = 0, len_ = 0;
+};
+
+struct ClientResult {
+  LatencyHistogram latency;
+  uint64_t ops = 0;
+  bool ok = true;
+};
+
+static bool preload(const LoadOptions &options, const std::string &value) {
+  int fd = connect_loopback(options.port);
+  if (fd < 0) {
+    return false;
+  }
+  auto reader = std::make_unique<ReplyReader>(fd);
+  bool ok = reader->read_replies(1, [] {}); // welcome
+
+  const uint64_t batch = 1000;
+  std::string out;
+  for (uint64_t first = 0; ok && first < options.keys; first += batch) {
+    out.clear();
+    int amount = 0;
+    for (uint64_t key = first; key < options.keys && key < first + batch;
+         ++key) {
+      generators.at("set")(out, key, value);
+      generators.at("hset")(out, key, value);
+      generators.at("ladd")(out, key, value);
+      amount += 3;
+    }
+    ok = send_all(fd, out) && reader->read_replies(amount, [] {});
+  }
+  close(fd);
+  return ok;
+}
+
+static void run_client(const LoadOptions &options,
+                       const std::vector<MixEntry> &mix,
+                       const std::string &value, Clock::time_point deadline,
+                       uint32_t seed, ClientResult &result) {
+  int fd = connect_loopback(options.port);
+  if (fd < 0) {
+    result.ok = false;
+    return;
+  }
+  auto reader = std::make_unique<ReplyReader>(fd);
+  if (!reader->read_replies(1, [] {})) {
+    result.ok = false;
+    close(fd);
+    return;
+  }
+
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<uint64_t> key_dist(0, options.keys - 1);
+  std::uniform_int_distribution<uint32_t> mix_dist(
+      0, mix.back().cumulative_weight - 1);
+
+  std::string out;
+  while (Clock::now() < deadline) {
+    out.clear();
+    for (int i = 0; i < options.pipeline; ++i) {
+      uint32_t pick = mix_dist(rng);
+      size_t idx = 0;
+      while (mix[idx].cumulative_weight <= pick) {
+        ++idx;
+      }
+      (*mix[idx].gen)(out, key_dist(rng), value);
+    }
+
+    auto start = Clock::now();
+    if (!send_all(fd, out)) {
+      result.ok = false;
+      break;
+    }
+    // each reply is timed from the moment its batch was sent
+    bool ok = reader->read_replies(options.pipeline, [&] {
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - start);
+      result.latency.record(elapsed.count());
+    });
+    if (!ok) {
+      result.ok = false;
+      break;
+    }
+    result.ops += options.pipeline;
+  }
+  close(fd);
+}
+
+int run_load(const LoadOptions &options) {
+  std::vector<MixEntry> mix;
+  if (!parse_mix(options.mix, mix)) {
+    return 1;
+  }
+
+  if (!options.external) {
+    std::thread([port = options.port] {
+      ServerConfig config;
+      config.port = port;
+      DatabaseServer server(config);
+      server.run();
+    }).detach();
+  }
+
+  // wait for the server to accept connections
+  int probe = -1;
+  for (int attempt = 0; attempt < 50 && probe < 0; ++attempt) {
+    probe = connect_loopback(options.port);
+    if (probe < 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  if (probe < 0) {
+    std::cerr << "could not connect to port " << options.port << std::endl;
+    return 1;
+  }
+  close(probe);
+
+  std::string value(options.value_size, 'x');
+  if (!preload(options, value)) {
+    std::cerr << "preloading the keyspace failed" << std::endl;
+    return 1;
+  }
+
+  std::vector<ClientResult> results(options.clients);
+  std::vector<std::thread> threads;
+  threads.reserve(options.clients);
+  auto start = Clock::now();
+  auto deadline = start + std::chrono::seconds(options.duration);
+  for (int i = 0; i < options.clients; ++i) {
+    threads.emplace_back(run_client, std::cref(options), std::cref(mix),
+                         std::cref(value), deadline, i + 1,
+                         std::ref(results[i]));
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  LatencyHistogram latency;
+  uint64_t ops = 0;
+  int failed = 0;
+  for (const auto &result : results) {
+    latency.merge(result.latency);
+    ops += result.ops;
+    failed += !result.ok;
+  }
+
+  printf("clients: %d  pipeline: %d  keys: %llu  value size: %zu  mix: %s\n",
+         options.clients, options.pipeline,
+         static_cast<unsigned long long>(options.keys), options.value_size,
+         options.mix.c_str());
+  printf("ops: %llu in %.2fs  =>  %.0f ops/sec\n",
+         static_cast<unsigned long long>(ops), seconds, ops / seconds);
+  printf("latency (us)  p50: %llu  p99: %llu  p99.9: %llu  max: %llu  "
+         "mean: %.1f\n",
+         static_cast<unsigned long long>(latency.percentile(50)),
+         static_cast<unsigned long long>(latency.percentile(99)),
+         static_cast<unsigned long long>(latency.percentile(99.9)),
+         static_cast<unsigned long long>(latency.max()), latency.mean());
+  if (failed) {
+    printf("%d clients failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
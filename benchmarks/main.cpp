@@ -0,0 +1,75 @@
+#include "bench.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+static void usage() {
+  std::cerr
+      << "usage: benchmark micro [filter]\n"
+      << "       benchmark load [--clients n] [--pipeline n] [--keys n]\n"
+      << "                      [--value-size bytes] [--duration seconds]\n"
+      << "                      [--mix get:80,set:20] [--port p] [--external]"
+      << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  if (strcmp(argv[1], "micro") == 0) {
+    return run_micro(argc > 2 ? argv[2] : "");
+  }
+
+  if (strcmp(argv[1], "load") != 0) {
+    usage();
+    return 1;
+  }
+
+  LoadOptions options;
+  try {
+    for (int i = 2; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--external") {
+        options.external = true;
+        continue;
+      }
+      if (i + 1 >= argc) {
+        usage();
+        return 1;
+      }
+      std::string value = argv[++i];
+      if (arg == "--clients") {
+        options.clients = std::stoi(value);
+      } else if (arg == "--pipeline") {
+        options.pipeline = std::stoi(value);
+      } else if (arg == "--keys") {
+        options.keys = std::stoull(value);
+      } else if (arg == "--value-size") {
+        options.value_size = std::stoull(value);
+      } else if (arg == "--duration") {
+        options.duration = std::stoi(value);
+      } else if (arg == "--mix") {
+        options.mix = value;
+      } else if (arg == "--port") {
+        options.port = std::stoi(value);
+      } else {
+        usage();
+        return 1;
+      }
+    }
+  } catch (const std::exception &e) {
+    usage();
+    return 1;
+  }
+
+  if (options.clients < 1 || options.pipeline < 1 || options.keys < 1 ||
+      options.value_size < 1) {
+    usage();
+    return 1;
+  }
+
+  return run_load(options);
+}
@@ -0,0 +1,141 @@
+#include "bench.hpp"
+#include "command_handler.hpp"
+#include "output_buffer.hpp"
+#include "parser.hpp"
+#include "snapshotter.hpp"
+#include "storage.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const uint64_t KEY_AMOUNT = 10000;
+
+// keeps the compiler from dropping the benchmarked work
+template <typename T> static void do_not_optimize(const T &value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+static std::vector<std::string> make_keys(const std::string &prefix) {
+  std::vector<std::string> keys;
+  keys.reserve(KEY_AMOUNT);
+  for (uint64_t i = 0; i < KEY_AMOUNT; ++i) {
+    keys.push_back(prefix + std::to_string(i));
+  }
+  return keys;
+}
+
+template <typename F>
+static void bench(const std::string &filter, const char *name,
+                  uint64_t iterations, F &&fn) {
+  if (!filter.empty() && std::string(name).find(filter) == std::string::npos) {
+    return;
+  }
+  auto start = Clock::now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    fn(i);
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start);
+  double per_op = elapsed.count() / iterations;
+  printf("%-32s %12.1f ns/op %14.0f ops/sec\n", name, per_op, 1e9 / per_op);
+  // snapshot children are forked from here and must not inherit the line.
+  fflush(stdout);
+}
+
+int run_micro(const std::string &filter) {
+  const uint64_t iterations = 1000000;
+  auto keys = make_keys("key:");
+  // keys[] hold strings, counters stay integer encoded
+  auto counters = make_keys("counter:");
+  std::string small_value(16, 'x');
+  std::string large_value(128 * 1024, 'x');
+
+  Parser parser;
+  bench(filter, "parser/set", iterations, [&](uint64_t) {
+    auto cmd = parser.parse("SET key:1234 some-value-of-16b");
+    do_not_optimize(cmd);
+  });
+
+  {
+    Storage storage;
+    bench(filter, "storage/set", iterations, [&](uint64_t i) {
+      storage.set(keys[i % KEY_AMOUNT], small_value);
+    });
+    bench(filter, "storage/get", iterations, [&](uint64_t i) {
+      auto value = storage.get(keys[i % KEY_AMOUNT]);
+      do_not_optimize(value);
+    });
+    bench(filter, "storage/incr", iterations, [&](uint64_t i) {
+      int64_t value;
+      auto status = storage.incrby(counters[i % KEY_AMOUNT], 1, value);
+      do_not_optimize(status);
+      do_not_optimize(value);
+    });
+    bench(filter, "storage/hset", iterations, [&](uint64_t i) {
+      storage.hset("hash", keys[i % KEY_AMOUNT], small_value);
+    });
+    bench(filter, "storage/hget", iterations, [&](uint64_t i) {
+      auto value = storage.hget("hash", keys[i % KEY_AMOUNT]);
+      do_not_optimize(value);
+    });
+    bench(filter, "storage/del+set", iterations, [&](uint64_t i) {
+      storage.del(keys[i % KEY_AMOUNT]);
+      storage.set(keys[i % KEY_AMOUNT], small_value);
+    });
+  }
+
+  {
+    auto storage = std::make_shared<Storage>();
+    CommandHandler handler(storage);
+    storage->set("small", small_value);
+    storage->set("large", large_value);
+    Command set_cmd{"SET", {"key:1", small_value}};
+    Command get_small{"GET", {"small"}};
+    Command get_large{"GET", {"large"}};
+    OutputBuffer reply;
+
+    bench(filter, "handler/set", iterations, [&](uint64_t) {
+      handler.handle(set_cmd, reply);
+      reply.consume(reply.size());
+    });
+    bench(filter, "handler/get-16b", iterations, [&](uint64_t) {
+      handler.handle(get_small, reply);
+      reply.consume(reply.size());
+    });
+    bench(filter, "handler/get-128k", iterations / 10, [&](uint64_t) {
+      handler.handle(get_large, reply);
+      reply.consume(reply.size());
+    });
+  }
+
+  {
+    auto storage = std::make_shared<Storage>();
+    for (const auto &key : keys) {
+      storage->set(key, small_value);
+      storage->hset("hash:" + key, "field", small_value);
+    }
+    Snapshotter snapshotter(storage);
+    SnapshotFormat format = SnapshotFormat::CUSTOM;
+    std::string filename =
+        "/tmp/cpp_redis_bench_" + std::to_string(getpid()) + ".snapshot";
+
+    // save forks, the child is waited for so the write is included.
+    bench(filter, "snapshotter/save-20k", 20, [&](uint64_t) {
+      bool ok;
+      snapshotter.save(filename, format);
+      snapshotter.reap(ok, true);
+    });
+    bench(filter, "snapshotter/load-20k", 20, [&](uint64_t) {
+      snapshotter.load(filename, format);
+    });
+    unlink(filename.c_str());
+  }
+
+  return 0;
+}
@@ -1,19 +1,41 @@
 #ifndef COMMANDHANDLER_HPP
 #define COMMANDHANDLER_HPP
 
+#include "output_buffer.hpp"
 #include "parser.hpp"
 #include "storage.hpp"
 #include "snapshotter.hpp"
+#include "stats.hpp"
+
+#include <chrono>
+#include <memory>
+#include <string>
 
 class CommandHandler {
 public:
-  explicit CommandHandler(std::shared_ptr<Storage> storage);
+  explicit CommandHandler(std::shared_ptr<Storage> storage,
+                          std::shared_ptr<Stats> stats =
+                              std::make_shared<Stats>());
+
+  // appends the reply to `reply`, typically the connection's write buffer.
+  void handle(const Command &cmd, OutputBuffer &reply);
+  std::string handle(const Command &cmd);
 
-  std::string handle(const Command& cmd);
+  // records a background save that finished since the last call, the
+  // server calls it once per loop iteration.
+  void reap_save();
+  bool saving() const { return snapshotter_->saving(); }
 
 private:
+  // returns false for unknown commands
+  bool execute(const Command &cmd, OutputBuffer &reply);
+  void info(const std::string &section, OutputBuffer &reply);
+  void slowlog(const Command &cmd, OutputBuffer &reply);
+
   std::shared_ptr<Storage> storage_;
+  std::shared_ptr<Stats> stats_;
   std::unique_ptr<Snapshotter> snapshotter_;
+  std::chrono::steady_clock::time_point save_start_;
 };
 
 #endif
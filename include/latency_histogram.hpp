@@ -0,0 +1,40 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram in the spirit of HdrHistogram: values below 64 are
+// exact, above that every power of two is split into 32 buckets, which keeps
+// the relative error of a percentile at about 3% over the full uint64 range.
+class LatencyHistogram {
+public:
+  void record(uint64_t value);
+  void merge(const LatencyHistogram &other);
+  void reset();
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const;
+  // p in [0, 100]
+  uint64_t percentile(double p) const;
+
+private:
+  static const int SUB_BUCKET_BITS = 5;
+  static const size_t LINEAR_BUCKETS = 64;
+  static const size_t BUCKET_AMOUNT =
+      LINEAR_BUCKETS + (64 - 6) * (1 << SUB_BUCKET_BITS);
+
+  static size_t bucket_index(uint64_t value);
+  static uint64_t bucket_value(size_t idx);
+
+  std::array<uint64_t, BUCKET_AMOUNT> counts_{};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LAZY_FREE_HPP
+#define LAZY_FREE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// hashes and lists with more elements than this, and strings of at least
+// LAZYFREE_BLOB_BYTES, are destroyed on the background thread.
+static const size_t LAZYFREE_THRESHOLD = 64;
+static const size_t LAZYFREE_BLOB_BYTES = 1024 * 1024;
+
+// Destroys detached values on a background thread so freeing a huge hash,
+// list or a whole keyspace never runs on the event loop.
+class LazyFree {
+public:
+  LazyFree();
+  ~LazyFree();
+
+  // takes ownership of `object`, it's destroyed off the calling thread.
+  template <typename T> void release(T &&object) {
+    push(std::make_shared<std::decay_t<T>>(std::forward<T>(object)));
+  }
+
+  // objects handed over but not destroyed yet
+  uint64_t pending() const { return pending_.load(); }
+  // objects handed over so far
+  uint64_t released() const { return released_.load(); }
+  // blocks until everything released so far is destroyed.
+  void drain();
+
+private:
+  void push(std::shared_ptr<void> object);
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable drained_;
+  std::vector<std::shared_ptr<void>> queue_;
+  std::atomic<uint64_t> pending_{0};
+  std::atomic<uint64_t> released_{0};
+  bool running_ = true;
+  std::thread worker_;
+};
+
+#endif
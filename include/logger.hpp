@@ -0,0 +1,99 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+enum class LogLevel { DEBUG, INFO, WARN, ERROR };
+
+static const size_t LOG_RING_SIZE = 4096;
+static const size_t LOG_LINE_SIZE = 240;
+// each call site may log this many lines per window, the rest is counted
+// and reported once the window is over.
+static const uint32_t LOG_RATE_BURST = 20;
+static const int64_t LOG_RATE_WINDOW_MS = 1000;
+// call sites that get their own rate limit, any further ones are unlimited.
+static const size_t LOG_RATE_SLOTS = 256;
+
+// Leveled logger that never blocks the caller: lines are formatted into a
+// bounded lock-free ring and written to `fd` (stderr for the process wide
+// instance) by a background thread. When the ring is full the line is
+// dropped and counted instead.
+//
+// Forked children (snapshots) must not use it, the writer thread does not
+// exist there.
+class Logger {
+public:
+  static Logger &instance();
+
+  explicit Logger(int fd = STDERR_FILENO, uint32_t burst = LOG_RATE_BURST);
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  void log(LogLevel level, const char *fmt, ...)
+      __attribute__((format(printf, 3, 4)));
+  void set_level(LogLevel level) { level_.store(level); }
+  // blocks until everything queued so far is written.
+  void flush();
+
+  ~Logger();
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    LogLevel level;
+    int64_t time_ms;
+    char text[LOG_LINE_SIZE];
+  };
+
+  struct RateLimit {
+    std::atomic<const char *> fmt{nullptr};
+    std::atomic<int64_t> window_start{0};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};
+  };
+
+  RateLimit *find_limit(const char *fmt);
+  uint32_t roll_window(RateLimit &limit, int64_t now_ms);
+  bool allow(const char *fmt, int64_t now_ms, uint32_t &suppressed);
+  void report_suppressed(const char *fmt, int64_t now_ms, uint32_t count);
+  void flush_suppressed(int64_t now_ms);
+  bool has_suppressed() const;
+  bool ready() const;
+  void wake();
+  void write_sink(const char *data, int len);
+  bool push(LogLevel level, int64_t time_ms, const char *fmt, ...)
+      __attribute__((format(printf, 4, 5)));
+  bool drain();
+  void writer_loop();
+
+  std::array<Slot, LOG_RING_SIZE> slots_;
+  std::atomic<uint64_t> head_{0};
+  uint64_t tail_ = 0;
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::array<RateLimit, LOG_RATE_SLOTS> limits_;
+  std::atomic<LogLevel> level_{LogLevel::INFO};
+  std::atomic<bool> running_{true};
+  int fd_;
+  uint32_t burst_;
+  // the writer blocks on wake_ while idle, producers only signal it when
+  // it announced that through sleeping_.
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::atomic<bool> sleeping_{false};
+  std::thread writer_;
+};
+
+#define LOG_DEBUG(...) Logger::instance().log(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) Logger::instance().log(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) Logger::instance().log(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) Logger::instance().log(LogLevel::ERROR, __VA_ARGS__)
+
+#endif
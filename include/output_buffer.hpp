@@ -0,0 +1,54 @@
+#ifndef OUTPUT_BUFFER_HPP
+#define OUTPUT_BUFFER_HPP
+
+#include "storage.hpp"
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+
+// values at least this large are referenced instead of copied into a reply.
+static const size_t ZERO_COPY_THRESHOLD = 16 * 1024;
+static const int IOV_AMOUNT = 64;
+// small replies are packed into owned chunks of up to this size.
+static const size_t OUTPUT_CHUNK_SIZE = 16 * 1024;
+
+// Pending output of a connection. Small replies are copied into owned
+// chunks, large values are kept as references to the stored Blob, and the
+// whole queue is handed to writev without flattening it first.
+class OutputBuffer {
+public:
+  void append(std::string_view data);
+  void append(const Blob &blob);
+  // always references the blob, for payloads shared by many connections.
+  void append_shared(const Blob &blob);
+
+  bool empty() const;
+  size_t size() const;
+  // bytes kept alive by the queue, including sent ones of the front chunk.
+  size_t retained() const;
+
+  // fills at most `max` iovecs starting at the unsent front of the queue.
+  int fill_iov(struct iovec *iov, int max) const;
+  // drops `bytes` sent bytes from the front of the queue.
+  void consume(size_t bytes);
+
+  std::string str() const;
+
+private:
+  struct Chunk {
+    std::string owned;
+    Blob shared;
+
+    std::string_view view() const {
+      return shared ? std::string_view(*shared) : std::string_view(owned);
+    }
+  };
+
+  std::deque<Chunk> chunks_;
+  size_t offset_ = 0;
+  size_t size_ = 0;
+};
+
+#endif
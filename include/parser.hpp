@@ -3,6 +3,7 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct Command {
@@ -12,7 +13,7 @@ struct Command {
 
 class Parser {
 public:
-  std::optional<Command> parse(const std::string &input);
+  std::optional<Command> parse(std::string_view input);
 };
 
 #endif
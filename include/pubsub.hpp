@@ -0,0 +1,53 @@
+#ifndef PUBSUB_HPP
+#define PUBSUB_HPP
+
+#include "storage.hpp"
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// default hard output limit for subscribers, see ServerConfig.
+static const size_t PUBSUB_OUTPUT_LIMIT = 32 * 1024 * 1024;
+
+// glob-style matching as used by PSUBSCRIBE: *, ?, [abc], [a-z], [^a], \x
+bool glob_match(std::string_view pattern, std::string_view str);
+
+// Channel and pattern subscriptions by connection fd. A published message
+// is encoded once into a Blob and every subscriber gets a reference to it.
+class PubSub {
+public:
+  using Deliver = std::function<void(int fd, const Blob &message)>;
+
+  // return the number of subscriptions `fd` holds afterwards
+  size_t subscribe(int fd, const std::string &channel);
+  size_t unsubscribe(int fd, const std::string &channel);
+  size_t psubscribe(int fd, const std::string &pattern);
+  size_t punsubscribe(int fd, const std::string &pattern);
+
+  std::vector<std::string> channels(int fd) const;
+  std::vector<std::string> patterns(int fd) const;
+  size_t subscriptions(int fd) const;
+
+  // drops every subscription of a closed connection.
+  void remove(int fd);
+
+  // returns the number of deliveries.
+  size_t publish(const std::string &channel, const std::string &message,
+                 const Deliver &deliver);
+
+private:
+  struct ClientSubscriptions {
+    std::unordered_set<std::string> channels;
+    std::unordered_set<std::string> patterns;
+  };
+
+  std::unordered_map<std::string, std::unordered_set<int>> channels_;
+  std::unordered_map<std::string, std::unordered_set<int>> patterns_;
+  std::unordered_map<int, ClientSubscriptions> clients_;
+};
+
+#endif
@@ -2,36 +2,123 @@
 #define SERVER_HPP
 
 #include "command_handler.hpp"
+#include "logger.hpp"
+#include "output_buffer.hpp"
 #include "parser.hpp"
+#include "pubsub.hpp"
+#include "stats.hpp"
+#include "timer_wheel.hpp"
+#include "tracking.hpp"
 #include "storage.hpp"
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <unordered_map>
+#include <string>
+#include <sys/event.h>
+#include <utility>
+#include <vector>
 
 struct uc {
   int uc_fd;
   char *uc_addr;
+  // unique per connection, tells a reused fd apart in the timer wheel
+  uint64_t id;
+  uint64_t last_active_ms;
+  // when the output buffer went over the soft limit, 0 while below
+  uint64_t soft_limit_since_ms;
   std::string read_buffer;
-  std::string write_buffer;
+  OutputBuffer write_buffer;
+  bool write_enabled;
+  // MULTI/EXEC state, watched keys with the version seen at WATCH time
+  bool in_multi;
+  std::vector<Command> queued;
+  std::vector<std::pair<std::string, uint64_t>> watched;
+  // pushes for this client raised by its own command, sent after the reply
+  std::vector<Blob> deferred;
+  bool closing;
 };
 
 static const uint16_t EVENT_AMOUNT = 256;
-static const uint16_t USER_AMOUNT = 256;
+static const uint32_t MAX_CLIENTS = 10000;
+static const size_t READ_BUFFER_SIZE = 16 * 1024;
+// file descriptors kept for the listener, snapshots and the logger
+static const uint32_t RESERVED_FDS = 32;
+// resolution of idle timeouts, the timer wheel advances once per tick
+static const uint64_t TIMER_TICK_MS = 1000;
+// how often a running SAVE child is checked for while no client is active
+static const long SAVE_POLL_MS = 10;
+
+// a client is disconnected once its pending output exceeds `hard_bytes`,
+// or stays above `soft_bytes` for `soft_seconds`. 0 disables a limit.
+struct OutputLimit {
+  size_t hard_bytes;
+  size_t soft_bytes;
+  uint32_t soft_seconds;
+};
+
+struct ServerConfig {
+  int port = 3000;
+  uint32_t maxclients = MAX_CLIENTS;
+  // seconds a client may stay silent before it's closed, 0 means never
+  uint32_t timeout = 0;
+  OutputLimit client_output_limit = {0, 0, 0};
+  // subscribers only receive, a slow one would otherwise buffer forever
+  OutputLimit pubsub_output_limit = {PUBSUB_OUTPUT_LIMIT,
+                                     PUBSUB_OUTPUT_LIMIT / 4, 60};
+  LogLevel loglevel = LogLevel::INFO;
+};
+
 class DatabaseServer {
 public:
-  explicit DatabaseServer(int port);
+  explicit DatabaseServer(const ServerConfig &config);
 
   void run();
 
 private:
   int conn_add(int fd);
   int conn_delete(int fd);
+  uc *client(int fd);
+  void raise_fd_limit();
+  void reap_idle(int fd, uint64_t id);
+  bool enforce_output_limit(int fd, uc &client_info);
+  void close_later(int fd, uc &client_info);
+  void queue_change(int fd, int16_t filter, uint16_t flags);
+  bool flush_client(int fd, uc &client_info);
+  void set_write_interest(int fd, uc &client_info, bool enable);
+  void dispatch(uc &client_info, Command &&cmd);
+  void run_command(uc &client_info, Command &&cmd);
+  void transaction_command(uc &client_info, const Command &cmd);
+  void execute(uc &client_info, const Command &cmd);
+  void record_command(const Command &cmd,
+                      std::chrono::steady_clock::time_point start);
+  void pubsub_command(uc &client_info, const Command &cmd);
+  void client_command(uc &client_info, const Command &cmd);
+  void deliver(int fd, const Blob &message);
+  void unwatch_all(uc &client_info);
   void handle_client_read(int client_socket);
   void handle_client_write(int client_socket);
-  int port_, kq_;
+  ServerConfig config_;
+  int kq_;
   std::shared_ptr<Storage> storage_;
+  std::shared_ptr<Stats> stats_;
   std::unique_ptr<CommandHandler> commandHandler_;
   Parser parser_;
-  std::unordered_map<int, uc> users_;
+  // connections live in a slab allocated once for maxclients, fd_slots_
+  // maps an fd to its slot (-1 if none) and free_slots_ holds the unused.
+  std::vector<uc> clients_;
+  std::vector<int32_t> fd_slots_;
+  std::vector<uint32_t> free_slots_;
+  uint64_t next_client_id_ = 1;
+  uint64_t now_ms_ = 0;
+  // the connection whose command is running, -1 between commands
+  int executing_fd_ = -1;
+  TimerWheel idle_wheel_;
+  std::vector<struct kevent> changes_;
+  std::vector<int> pending_close_;
+  PubSub pubsub_;
+  Tracking tracking_;
+  // bound to deliver(), shared by pubsub and tracking
+  PubSub::Deliver deliver_;
 };
 
 #endif
@@ -4,9 +4,11 @@
 #include "storage.hpp"
 #include <cstdint>
 #include <fstream>
+#include <sys/types.h>
 
 static const uint8_t MAP = 0;
 static const uint8_t HMAP = 1;
+static const uint8_t INT = 2;
 static const uint8_t LIST = 3;
 enum class SnapshotFormat { CUSTOM, CSV, JSON };
 
@@ -19,18 +21,31 @@ bool write_uint8(std::ofstream &outfile, const uint8_t &c);
 bool read_uint8(std::ifstream &infile, uint8_t &c);
 bool write_uint32(std::ofstream &outfile, const uint32_t &number);
 bool read_uint32(std::ifstream &infile, uint32_t &number);
+bool write_uint64(std::ofstream &outfile, const uint64_t &number);
+bool read_uint64(std::ifstream &infile, uint64_t &number);
 bool write_string(std::ofstream &outfile, const std::string &str);
 bool read_string(std::ifstream &infile, std::string &str);
 
 class Snapshotter {
 public:
   explicit Snapshotter(const std::shared_ptr<Storage> storage);
+  // waits for a save that is still running.
+  ~Snapshotter();
 
+  // forks a child that writes the file in the background, fails while the
+  // previous save has not been reaped.
   bool save(const std::string &filename, SnapshotFormat &format);
   bool load(const std::string &filename, SnapshotFormat &format);
 
+  bool saving() const { return child_ > 0; }
+  // collects the save child once it exited, or waits for it with `block`.
+  // Returns true once per save, `ok` tells whether the whole file was
+  // written.
+  bool reap(bool &ok, bool block = false);
+
 private:
   std::shared_ptr<Storage> storage_;
+  pid_t child_ = -1;
 };
 
 #endif
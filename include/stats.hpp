@@ -0,0 +1,69 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "latency_histogram.hpp"
+#include "parser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+static const uint64_t SLOWLOG_THRESHOLD_US = 10000;
+static const size_t SLOWLOG_MAX_LEN = 128;
+// longest command line kept in a slowlog entry
+static const size_t SLOWLOG_MAX_COMMAND = 128;
+
+struct CommandStats {
+  uint64_t calls = 0;
+  // nanoseconds
+  LatencyHistogram latency;
+};
+
+struct SlowlogEntry {
+  uint64_t id;
+  int64_t timestamp;
+  uint64_t duration_us;
+  std::string command;
+};
+
+// Counters shared by the server and the command handler. Everything runs
+// on the event loop thread, so plain integers are enough.
+class Stats {
+public:
+  void record_command(const Command &cmd, bool known, uint64_t duration_ns);
+  void record_loop_iteration(uint64_t duration_us);
+
+  uint64_t connected_clients = 0;
+  uint64_t maxclients = 0;
+  uint64_t total_connections = 0;
+  uint64_t rejected_connections = 0;
+  uint64_t timed_out_clients = 0;
+  uint64_t output_limit_disconnections = 0;
+  uint64_t total_commands = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+
+  uint64_t saves = 0;
+  uint64_t failed_saves = 0;
+  // time the SAVE command blocked in fork()
+  uint64_t last_save_fork_us = 0;
+  // from the fork until the child was reaped, set once it finished
+  uint64_t last_save_us = 0;
+  bool last_save_ok = true;
+  uint64_t loads = 0;
+  uint64_t last_load_us = 0;
+
+  uint64_t loop_iterations = 0;
+  // time spent serving one batch of events, i.e. how long a ready client
+  // may wait before the loop gets back to it.
+  LatencyHistogram loop_lag_us;
+
+  std::unordered_map<std::string, CommandStats> commands;
+
+  uint64_t slowlog_threshold_us = SLOWLOG_THRESHOLD_US;
+  uint64_t slowlog_next_id = 0;
+  std::deque<SlowlogEntry> slowlog;
+};
+
+#endif
@@ -3,43 +3,110 @@
 
 #include <cstdint>
 #include <functional>
-#include <optional>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
+#include <vector>
 
-using CPPRedisValue =
-    std::variant<std::string, std::vector<std::string>,
-                 std::unordered_map<std::string, std::string>>;
+class LazyFree;
+
+// string values are immutable and refcounted, so a reply can reference the
+// stored bytes while the key is overwritten or deleted underneath it.
+using Blob = std::shared_ptr<const std::string>;
+
+using CPPRedisHash = std::unordered_map<std::string, Blob>;
+using CPPRedisList = std::vector<std::string>;
+// strings holding a canonical integer are kept as int64_t and only turned
+// into text when read, so counters never parse or format on INCR.
+using CPPRedisValue = std::variant<Blob, int64_t, CPPRedisList, CPPRedisHash>;
+
+Blob make_blob(std::string value);
+bool parse_int64(std::string_view str, int64_t &number);
+// plain decimal numbers with an optional exponent, no hex, inf or nan.
+bool parse_double(std::string_view str, double &number);
+std::string format_int64(int64_t number);
+
+// outcome of INCR and friends. NOT_A_NUMBER also covers an overflowing or
+// non-finite result.
+enum class NumberStatus { OK, WRONG_TYPE, NOT_A_NUMBER };
+
+// keys per type, strings include integer encoded ones.
+struct KeyspaceCounts {
+  uint64_t strings = 0;
+  uint64_t lists = 0;
+  uint64_t hashes = 0;
+};
 
 class Storage {
 public:
-  Storage() = default;
+  // with a LazyFree, large values dropped by UNLINK, an overwrite or LOAD
+  // are destroyed on its background thread instead of inline.
+  explicit Storage(std::shared_ptr<LazyFree> lazy_free = nullptr);
 
   uint32_t size();
+  // kept up to date on every insert, erase and type change.
+  const KeyspaceCounts &counts() const { return counts_; }
   void hset(const std::string &key, const std::string &field,
             const std::string &value);
   void ladd(const std::string &key, const std::string &value);
   void set(const std::string &key, const std::string &value);
 
-  std::optional<std::string> hget(const std::string &key,
-                                  const std::string &field);
-  std::optional<std::string> lget(const std::string &key, const int &idx);
-  std::optional<std::string> get(const std::string &key);
+  // Read accessors hand out the stored value instead of a copy; an empty
+  // Blob or nullptr means a miss. lget's pointer is invalidated by the next
+  // mutation of the list.
+  Blob hget(const std::string &key, const std::string &field);
+  const std::string *lget(const std::string &key, const int &idx);
+  Blob get(const std::string &key);
+
+  // Atomic read-modify-write on integer values, a missing key or field
+  // counts as 0. `result` is only set on OK, incrbyfloat sets it to the new
+  // value as stored text.
+  NumberStatus incrby(const std::string &key, int64_t delta, int64_t &result);
+  NumberStatus incrbyfloat(const std::string &key, double delta,
+                           std::string &result);
+  NumberStatus hincrby(const std::string &key, const std::string &field,
+                       int64_t delta, int64_t &result);
 
   bool hdel(const std::string &key, const std::string &field);
   bool ldel(const std::string &key, const int &idx);
   bool del(const std::string &key);
+  // like del, but a large value is freed in the background.
+  bool unlink(const std::string &key);
 
   using KVPairVisitor =
       std::function<void(const std::string &, const CPPRedisValue &)>;
   void visitAll(const KVPairVisitor &visitor);
 
-  bool
-  setKVStore(const std::unordered_map<std::string, CPPRedisValue> &kv_store);
+  bool setKVStore(std::unordered_map<std::string, CPPRedisValue> kv_store);
+
+  // Optimistic locking for WATCH. Versions are only kept for keys that
+  // somebody watches, every write to such a key bumps its version.
+  uint64_t watch(const std::string &key);
+  void unwatch(const std::string &key);
+  uint64_t version(const std::string &key);
+
+  // called on every write with the key that changes, an empty key stands
+  // for the whole keyspace (LOAD).
+  using KeyListener = std::function<void(const std::string &)>;
+  void setKeyListener(KeyListener listener);
 
 private:
+  struct WatchedKey {
+    uint64_t version;
+    uint32_t watchers;
+  };
+
   std::unordered_map<std::string, CPPRedisValue> kvstore_;
+  std::unordered_map<std::string, WatchedKey> watched_;
+  KeyListener key_listener_;
+  std::shared_ptr<LazyFree> lazy_free_;
+  KeyspaceCounts counts_;
+
+  void touch(const std::string &key);
+  void dispose(CPPRedisValue &value);
+  void count(const CPPRedisValue &value, int64_t delta);
 
   template <typename T> T *get_if_type(const std::string &key);
 };
@@ -0,0 +1,40 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+static const size_t TIMER_WHEEL_SLOTS = 64;
+
+// Hashed timer wheel for connection deadlines. Scheduling and expiring are
+// O(1), the owner drives it with one tick() per period. Entries are never
+// cancelled: the callback gets the connection's fd and id and decides
+// whether the entry is stale or needs to be scheduled again, so activity
+// on a connection costs nothing here.
+class TimerWheel {
+public:
+  using Expire = std::function<void(int fd, uint64_t id)>;
+
+  explicit TimerWheel(size_t slots = TIMER_WHEEL_SLOTS);
+
+  // fires after `ticks` calls to tick(), at least 1. deadlines beyond the
+  // wheel fire once it went round and have to be rescheduled by the caller.
+  void schedule(int fd, uint64_t id, uint64_t ticks);
+  void tick(const Expire &expire);
+  size_t size() const { return size_; }
+
+private:
+  struct Entry {
+    int fd;
+    uint64_t id;
+  };
+
+  std::vector<std::vector<Entry>> slots_;
+  std::vector<Entry> expired_;
+  size_t cursor_ = 0;
+  size_t size_ = 0;
+};
+
+#endif
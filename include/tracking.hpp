@@ -0,0 +1,64 @@
+#ifndef TRACKING_HPP
+#define TRACKING_HPP
+
+#include "storage.hpp"
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// keys remembered for default-mode tracking, beyond this the least recently
+// remembered keys are invalidated early to make room.
+static const size_t TRACKING_MAX_KEYS = 1000000;
+
+// Server-assisted client-side caching. In default mode the keys a client
+// read are remembered and it's told once when one of them changes. In
+// broadcast mode nothing is remembered, the client hears about every
+// change to keys starting with one of its prefixes.
+//
+// Remembered keys aren't cleared when a client turns tracking off or
+// disconnects; a stale entry can at worst cause one spurious invalidation.
+class Tracking {
+public:
+  using Invalidate = std::function<void(int fd, const Blob &message)>;
+
+  explicit Tracking(size_t max_keys = TRACKING_MAX_KEYS)
+      : max_keys_(max_keys) {}
+
+  void enable(int fd, bool bcast, const std::vector<std::string> &prefixes);
+  void disable(int fd);
+  bool enabled(int fd) const;
+
+  // records a read by `fd` if it tracks in default mode.
+  void remember(int fd, const std::string &key, const Invalidate &invalidate);
+  // an empty key means the whole keyspace changed.
+  void key_changed(const std::string &key, const Invalidate &invalidate);
+
+  size_t tracked_keys() const { return keys_.size(); }
+
+private:
+  struct Client {
+    bool bcast;
+    std::vector<std::string> prefixes;
+  };
+
+  struct TrackedKey {
+    std::unordered_set<int> readers;
+    std::list<const std::string *>::iterator order;
+  };
+
+  void invalidate_key(const std::string &key, const Invalidate &invalidate);
+
+  size_t max_keys_;
+  std::unordered_map<int, Client> clients_;
+  std::unordered_map<std::string, TrackedKey> keys_;
+  // keys_ in insertion order, oldest first. points at the map's keys.
+  std::list<const std::string *> order_;
+  // bcast prefix -> clients, "" matches every key
+  std::unordered_map<std::string, std::unordered_set<int>> prefixes_;
+};
+
+#endif
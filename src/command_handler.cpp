@@ -1,132 +1,435 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
-#include <optional>
+#include <cstring>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 
 #include "command_handler.hpp"
 #include "snapshotter.hpp"
 
-CommandHandler::CommandHandler(std::shared_ptr<Storage> storage)
-    : storage_(storage) {
+CommandHandler::CommandHandler(std::shared_ptr<Storage> storage,
+                               std::shared_ptr<Stats> stats)
+    : storage_(storage), stats_(stats) {
   snapshotter_ = std::make_unique<Snapshotter>(storage);
 };
 
-std::string CommandHandler::handle(const Command &cmd) {
+static const char *NOT_AN_INTEGER =
+    "ERROR: value is not an integer or out of range\n";
+static const char *WRONG_TYPE =
+    "ERROR: WRONGTYPE operation against a key holding the wrong kind of "
+    "value\n";
+
+static void append_number(OutputBuffer &reply, NumberStatus status,
+                          int64_t number) {
+  if (status != NumberStatus::OK) {
+    reply.append(status == NumberStatus::WRONG_TYPE ? WRONG_TYPE
+                                                    : NOT_AN_INTEGER);
+    return;
+  }
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer) - 1, number);
+  *result.ptr++ = '\n';
+  reply.append(std::string_view(buffer, result.ptr - buffer));
+}
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void CommandHandler::handle(const Command &cmd, OutputBuffer &reply) {
+  auto start = std::chrono::steady_clock::now();
+  bool known = execute(cmd, reply);
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start);
+  stats_->record_command(cmd, known, elapsed.count());
+}
+
+bool CommandHandler::execute(const Command &cmd, OutputBuffer &reply) {
   if (cmd.name == "SET") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for SET command\n";
+      reply.append("ERROR: wrong number of arguments for SET command\n");
+      return true;
     }
 
     storage_->set(cmd.args[0], cmd.args[1]);
-    return "OK\n";
+    reply.append("OK\n");
   } else if (cmd.name == "GET") {
     if (cmd.args.size() != 1) {
-      return "ERROR: wrong number of arguments for GET command\n";
+      reply.append("ERROR: wrong number of arguments for GET command\n");
+      return true;
     }
 
     auto value = storage_->get(cmd.args[0]);
     if (value) {
-      return *value + "\n";
+      reply.append(value);
+      reply.append("\n");
+      return true;
     }
-    return "-1\n";
+    reply.append("-1\n");
   } else if (cmd.name == "DEL") {
     if (cmd.args.size() != 1) {
-      return "ERROR: wrong number of arguments for DEL command\n";
+      reply.append("ERROR: wrong number of arguments for DEL command\n");
+      return true;
     }
 
     bool deleted = storage_->del(cmd.args[0]);
 
-    return std::to_string(deleted) + "\n";
+    reply.append(deleted ? "1\n" : "0\n");
+  } else if (cmd.name == "UNLINK") {
+    if (cmd.args.size() != 1) {
+      reply.append("ERROR: wrong number of arguments for UNLINK command\n");
+      return true;
+    }
+
+    bool deleted = storage_->unlink(cmd.args[0]);
+
+    reply.append(deleted ? "1\n" : "0\n");
   } else if (cmd.name == "HSET") {
     if (cmd.args.size() != 3) {
-      return "ERROR: wrong number of arguments for HSET command\n";
+      reply.append("ERROR: wrong number of arguments for HSET command\n");
+      return true;
     }
 
     storage_->hset(cmd.args[0], cmd.args[1], cmd.args[2]);
-    return "OK\n";
+    reply.append("OK\n");
   } else if (cmd.name == "HGET") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for HGET command\n";
+      reply.append("ERROR: wrong number of arguments for HGET command\n");
+      return true;
     }
 
     auto value = storage_->hget(cmd.args[0], cmd.args[1]);
     if (value) {
-      return *value + "\n";
+      reply.append(value);
+      reply.append("\n");
+      return true;
     }
-    return "-1\n";
+    reply.append("-1\n");
   } else if (cmd.name == "HDEL") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for HDEL command\n";
+      reply.append("ERROR: wrong number of arguments for HDEL command\n");
+      return true;
     }
 
     bool deleted = storage_->hdel(cmd.args[0], cmd.args[1]);
 
-    return std::to_string(deleted) + "\n";
+    reply.append(deleted ? "1\n" : "0\n");
+  } else if (cmd.name == "INCR" || cmd.name == "DECR") {
+    if (cmd.args.size() != 1) {
+      reply.append("ERROR: wrong number of arguments for " + cmd.name +
+                   " command\n");
+      return true;
+    }
+
+    int64_t number = 0;
+    auto status =
+        storage_->incrby(cmd.args[0], cmd.name == "INCR" ? 1 : -1, number);
+    append_number(reply, status, number);
+  } else if (cmd.name == "INCRBY") {
+    if (cmd.args.size() != 2) {
+      reply.append("ERROR: wrong number of arguments for INCRBY command\n");
+      return true;
+    }
+
+    int64_t delta;
+    if (!parse_int64(cmd.args[1], delta)) {
+      reply.append(NOT_AN_INTEGER);
+      return true;
+    }
+    int64_t number = 0;
+    auto status = storage_->incrby(cmd.args[0], delta, number);
+    append_number(reply, status, number);
+  } else if (cmd.name == "INCRBYFLOAT") {
+    if (cmd.args.size() != 2) {
+      reply.append(
+          "ERROR: wrong number of arguments for INCRBYFLOAT command\n");
+      return true;
+    }
+
+    double delta;
+    if (!parse_double(cmd.args[1], delta)) {
+      reply.append("ERROR: value is not a valid float\n");
+      return true;
+    }
+    std::string value;
+    auto status = storage_->incrbyfloat(cmd.args[0], delta, value);
+    if (status != NumberStatus::OK) {
+      reply.append(status == NumberStatus::WRONG_TYPE
+                       ? WRONG_TYPE
+                       : "ERROR: value is not a valid float\n");
+      return true;
+    }
+    reply.append(value);
+    reply.append("\n");
+  } else if (cmd.name == "HINCRBY") {
+    if (cmd.args.size() != 3) {
+      reply.append("ERROR: wrong number of arguments for HINCRBY command\n");
+      return true;
+    }
+
+    int64_t delta;
+    if (!parse_int64(cmd.args[2], delta)) {
+      reply.append(NOT_AN_INTEGER);
+      return true;
+    }
+    int64_t number = 0;
+    auto status = storage_->hincrby(cmd.args[0], cmd.args[1], delta, number);
+    append_number(reply, status, number);
   } else if (cmd.name == "LADD") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for LADD command\n";
+      reply.append("ERROR: wrong number of arguments for LADD command\n");
+      return true;
     }
 
     storage_->ladd(cmd.args[0], cmd.args[1]);
 
-    return "OK\n";
+    reply.append("OK\n");
   } else if (cmd.name == "LGET") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for LGET command\n";
+      reply.append("ERROR: wrong number of arguments for LGET command\n");
+      return true;
     }
 
     auto value = storage_->lget(cmd.args[0],
                                 std::strtoul(cmd.args[1].c_str(), nullptr, 10));
 
     if (value) {
-      return *value + "\n";
+      reply.append(*value);
+      reply.append("\n");
+      return true;
     }
-    return "-1\n";
+    reply.append("-1\n");
   } else if (cmd.name == "LDEL") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for LDEL command\n";
+      reply.append("ERROR: wrong number of arguments for LDEL command\n");
+      return true;
     }
 
     bool deleted = storage_->ldel(
         cmd.args[0], std::strtoul(cmd.args[1].c_str(), nullptr, 10));
 
-    return std::to_string(deleted) + "\n";
+    reply.append(deleted ? "1\n" : "0\n");
   } else if (cmd.name == "SAVE") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for SAVE command\n";
+      reply.append("ERROR: wrong number of arguments for SAVE command\n");
+      return true;
     }
 
     auto it = lookup.find(cmd.args[1]);
     if (it == lookup.end()) {
-      return "-1\n";
+      reply.append("-1\n");
+      return true;
     }
     SnapshotFormat format = it->second;
 
+    reap_save();
+    if (snapshotter_->saving()) {
+      reply.append("ERROR: a save is already in progress\n");
+      return true;
+    }
+
+    save_start_ = std::chrono::steady_clock::now();
     auto value = snapshotter_->save(cmd.args[0], format);
+    stats_->last_save_fork_us = elapsed_us(save_start_);
 
     if (!value) {
-      return "-1\n";
+      reply.append("-1\n");
+      return true;
     }
-    return "OK\n";
+    reply.append("OK\n");
   } else if (cmd.name == "LOAD") {
     if (cmd.args.size() != 2) {
-      return "ERROR: wrong number of arguments for LOAD command\n";
+      reply.append("ERROR: wrong number of arguments for LOAD command\n");
+      return true;
     }
 
     auto it = lookup.find(cmd.args[1]);
     if (it == lookup.end()) {
-      return "-1\n";
+      reply.append("-1\n");
+      return true;
     }
     SnapshotFormat format = it->second;
 
+    auto start = std::chrono::steady_clock::now();
     auto value = snapshotter_->load(cmd.args[0], format);
+    stats_->last_load_us = elapsed_us(start);
+    ++stats_->loads;
     if (value) {
-      return "OK\n";
+      reply.append("OK\n");
+      return true;
+    }
+
+    reply.append("-1\n");
+  } else if (cmd.name == "INFO") {
+    if (cmd.args.size() > 1) {
+      reply.append("ERROR: wrong number of arguments for INFO command\n");
+      return true;
     }
 
-    return "-1\n";
+    info(cmd.args.empty() ? "" : cmd.args[0], reply);
+  } else if (cmd.name == "SLOWLOG") {
+    slowlog(cmd, reply);
+  } else {
+    reply.append("ERROR: unknown command\n");
+    return false;
+  }
+  return true;
+}
+
+std::string CommandHandler::handle(const Command &cmd) {
+  OutputBuffer reply;
+  handle(cmd, reply);
+  return reply.str();
+}
+
+void CommandHandler::reap_save() {
+  bool ok;
+  if (!snapshotter_->reap(ok)) {
+    return;
+  }
+  stats_->last_save_us = elapsed_us(save_start_);
+  stats_->last_save_ok = ok;
+  ++stats_->saves;
+  if (!ok) {
+    ++stats_->failed_saves;
+  }
+}
+
+static void append_field(OutputBuffer &reply, const char *name,
+                         uint64_t value) {
+  reply.append(name);
+  reply.append(":");
+  reply.append(std::to_string(value));
+  reply.append("\n");
+}
+
+static bool wants(const std::string &section, const char *name) {
+  if (section.empty()) {
+    return true;
+  }
+  if (section.size() != strlen(name)) {
+    return false;
+  }
+  for (size_t i = 0; i < section.size(); ++i) {
+    if (tolower(section[i]) != name[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// INFO [section], one field:value per line, terminated by an empty line.
+void CommandHandler::info(const std::string &section, OutputBuffer &reply) {
+  static const char *const sections[] = {"clients", "stats", "persistence",
+                                         "keyspace", "commandstats"};
+  if (std::none_of(std::begin(sections), std::end(sections),
+                   [&](const char *name) { return wants(section, name); })) {
+    reply.append("ERROR: unknown INFO section\n");
+    return;
+  }
+
+  if (wants(section, "clients")) {
+    reply.append("# Clients\n");
+    append_field(reply, "connected_clients", stats_->connected_clients);
+    append_field(reply, "maxclients", stats_->maxclients);
+    append_field(reply, "total_connections_received",
+                 stats_->total_connections);
+    append_field(reply, "rejected_connections", stats_->rejected_connections);
+    append_field(reply, "timed_out_clients", stats_->timed_out_clients);
+    append_field(reply, "output_limit_disconnections",
+                 stats_->output_limit_disconnections);
+  }
+  if (wants(section, "stats")) {
+    reply.append("# Stats\n");
+    append_field(reply, "total_commands_processed", stats_->total_commands);
+    append_field(reply, "total_net_input_bytes", stats_->bytes_in);
+    append_field(reply, "total_net_output_bytes", stats_->bytes_out);
+    append_field(reply, "event_loop_iterations", stats_->loop_iterations);
+    append_field(reply, "event_loop_lag_p50_us",
+                 stats_->loop_lag_us.percentile(50));
+    append_field(reply, "event_loop_lag_p99_us",
+                 stats_->loop_lag_us.percentile(99));
+    append_field(reply, "event_loop_lag_max_us", stats_->loop_lag_us.max());
+  }
+  if (wants(section, "persistence")) {
+    reap_save();
+    reply.append("# Persistence\n");
+    append_field(reply, "save_in_progress", snapshotter_->saving());
+    append_field(reply, "saves", stats_->saves);
+    append_field(reply, "failed_saves", stats_->failed_saves);
+    append_field(reply, "last_save_fork_us", stats_->last_save_fork_us);
+    append_field(reply, "last_save_us", stats_->last_save_us);
+    reply.append(stats_->last_save_ok ? "last_save_status:ok\n"
+                                      : "last_save_status:err\n");
+    append_field(reply, "loads", stats_->loads);
+    append_field(reply, "last_load_us", stats_->last_load_us);
+  }
+  if (wants(section, "keyspace")) {
+    const KeyspaceCounts &counts = storage_->counts();
+    reply.append("# Keyspace\n");
+    append_field(reply, "keys", storage_->size());
+    append_field(reply, "strings", counts.strings);
+    append_field(reply, "lists", counts.lists);
+    append_field(reply, "hashes", counts.hashes);
+  }
+  if (wants(section, "commandstats")) {
+    reply.append("# Commandstats\n");
+    for (const auto &entry : stats_->commands) {
+      const auto &latency = entry.second.latency;
+      char line[256];
+      snprintf(line, sizeof(line),
+               "cmdstat_%s:calls=%llu,p50_us=%.2f,p99_us=%.2f,p999_us=%.2f,"
+               "max_us=%.2f\n",
+               entry.first.c_str(),
+               static_cast<unsigned long long>(entry.second.calls),
+               latency.percentile(50) / 1000.0,
+               latency.percentile(99) / 1000.0,
+               latency.percentile(99.9) / 1000.0, latency.max() / 1000.0);
+      reply.append(line);
+    }
+  }
+  reply.append("\n");
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+void CommandHandler::slowlog(const Command &cmd, OutputBuffer &reply) {
+  std::string sub = cmd.args.empty() ? "" : cmd.args[0];
+  for (char &c : sub) {
+    c = toupper(c);
+  }
+
+  if (sub == "GET" && cmd.args.size() <= 2) {
+    size_t count = 10;
+    if (cmd.args.size() == 2) {
+      count = std::strtoul(cmd.args[1].c_str(), nullptr, 10);
+    }
+    // newest first, one entry per line, terminated by an empty line.
+    for (const auto &entry : stats_->slowlog) {
+      if (count-- == 0) {
+        break;
+      }
+      reply.append(std::to_string(entry.id) + " " +
+                   std::to_string(entry.timestamp) + " " +
+                   std::to_string(entry.duration_us) + " " + entry.command +
+                   "\n");
+    }
+    reply.append("\n");
+  } else if (sub == "LEN" && cmd.args.size() == 1) {
+    reply.append(std::to_string(stats_->slowlog.size()) + "\n");
+  } else if (sub == "RESET" && cmd.args.size() == 1) {
+    stats_->slowlog.clear();
+    reply.append("OK\n");
   } else {
-    return "ERROR: unknown command\n";
+    reply.append("ERROR: usage SLOWLOG GET [count] | LEN | RESET\n");
   }
 }
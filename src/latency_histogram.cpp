@@ -0,0 +1,80 @@
+#include "latency_histogram.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+size_t LatencyHistogram::bucket_index(uint64_t value) {
+  if (value < LINEAR_BUCKETS) {
+    return value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  size_t sub = (value >> shift) & ((1 << SUB_BUCKET_BITS) - 1);
+  return LINEAR_BUCKETS + (msb - 6) * (1 << SUB_BUCKET_BITS) + sub;
+}
+
+// midpoint of the bucket's range
+uint64_t LatencyHistogram::bucket_value(size_t idx) {
+  if (idx < LINEAR_BUCKETS) {
+    return idx;
+  }
+  size_t group = (idx - LINEAR_BUCKETS) >> SUB_BUCKET_BITS;
+  size_t sub = (idx - LINEAR_BUCKETS) & ((1 << SUB_BUCKET_BITS) - 1);
+  int shift = group + 6 - SUB_BUCKET_BITS;
+  uint64_t lower = static_cast<uint64_t>((1 << SUB_BUCKET_BITS) + sub) << shift;
+  return lower + ((uint64_t{1} << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  ++counts_[bucket_index(value)];
+  ++count_;
+  sum_ += value;
+  if (value < min_) {
+    min_ = value;
+  }
+  if (value > max_) {
+    max_ = value;
+  }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (size_t i = 0; i < BUCKET_AMOUNT; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  if (other.min_ < min_) {
+    min_ = other.min_;
+  }
+  if (other.max_ > max_) {
+    max_ = other.max_;
+  }
+}
+
+void LatencyHistogram::reset() { *this = LatencyHistogram(); }
+
+double LatencyHistogram::mean() const {
+  return count_ ? static_cast<double>(sum_) / count_ : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(p / 100.0 * count_ + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank >= count_) {
+    return max_;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKET_AMOUNT; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      uint64_t value = bucket_value(i);
+      return value > max_ ? max_ : value;
+    }
+  }
+  return max_;
+}
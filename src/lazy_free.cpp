@@ -0,0 +1,53 @@
+#include "lazy_free.hpp"
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+LazyFree::LazyFree() { worker_ = std::thread(&LazyFree::run, this); }
+
+LazyFree::~LazyFree() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cv_.notify_one();
+  worker_.join();
+}
+
+void LazyFree::push(std::shared_ptr<void> object) {
+  ++pending_;
+  ++released_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(object));
+  }
+  cv_.notify_one();
+}
+
+void LazyFree::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  drained_.wait(lock, [this] { return pending_.load() == 0; });
+}
+
+void LazyFree::run() {
+  std::vector<std::shared_ptr<void>> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return !queue_.empty() || !running_; });
+    if (queue_.empty()) {
+      return;
+    }
+    batch.swap(queue_);
+
+    // the actual destruction happens without holding the lock.
+    lock.unlock();
+    size_t freed = batch.size();
+    batch.clear();
+    lock.lock();
+
+    pending_ -= freed;
+    drained_.notify_all();
+  }
+}
@@ -0,0 +1,297 @@
+#include "logger.hpp"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+static const char *level_name(LogLevel level) {
+  switch (level) {
+  case LogLevel::DEBUG:
+    return "DEBUG";
+  case LogLevel::INFO:
+    return "INFO";
+  case LogLevel::WARN:
+    return "WARN";
+  case LogLevel::ERROR:
+    return "ERROR";
+  }
+  return "";
+}
+
+
+static int64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+Logger &Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger(int fd, uint32_t burst) : fd_(fd), burst_(burst) {
+  for (size_t i = 0; i < LOG_RING_SIZE; ++i) {
+    slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+  writer_ = std::thread(&Logger::writer_loop, this);
+}
+
+Logger::~Logger() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    running_.store(false);
+  }
+  wake_.notify_one();
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+}
+
+// call sites are told apart by their format string, each one claims its
+// own slot and probes on collisions. nullptr if the table is full.
+Logger::RateLimit *Logger::find_limit(const char *fmt) {
+  size_t start = (reinterpret_cast<uintptr_t>(fmt) >> 3) % LOG_RATE_SLOTS;
+  for (size_t i = 0; i < LOG_RATE_SLOTS; ++i) {
+    auto &limit = limits_[(start + i) % LOG_RATE_SLOTS];
+    const char *owner = limit.fmt.load(std::memory_order_acquire);
+    if (owner == nullptr &&
+        limit.fmt.compare_exchange_strong(owner, fmt,
+                                          std::memory_order_acq_rel)) {
+      return &limit;
+    }
+    if (owner == fmt) {
+      return &limit;
+    }
+  }
+  return nullptr;
+}
+
+// starts a new window if the current one is over, returns the lines
+// suppressed in the old one. only one thread wins the rollover.
+uint32_t Logger::roll_window(RateLimit &limit, int64_t now) {
+  int64_t start = limit.window_start.load(std::memory_order_relaxed);
+  if (now - start < LOG_RATE_WINDOW_MS ||
+      !limit.window_start.compare_exchange_strong(
+          start, now, std::memory_order_relaxed)) {
+    return 0;
+  }
+  limit.count.store(0, std::memory_order_relaxed);
+  return limit.suppressed.exchange(0, std::memory_order_relaxed);
+}
+
+bool Logger::allow(const char *fmt, int64_t now, uint32_t &suppressed) {
+  RateLimit *limit = find_limit(fmt);
+  suppressed = 0;
+  if (!limit) {
+    return true;
+  }
+  suppressed = roll_window(*limit, now);
+  if (limit->count.fetch_add(1, std::memory_order_relaxed) < burst_) {
+    return true;
+  }
+  // the first suppressed line makes an idle writer start watching the
+  // window, so the count is reported even if nothing is logged afterwards.
+  if (limit->suppressed.fetch_add(1, std::memory_order_relaxed) == 0) {
+    wake();
+  }
+  return false;
+}
+
+void Logger::report_suppressed(const char *fmt, int64_t now,
+                               uint32_t count) {
+  push(LogLevel::WARN, now, "%u similar messages suppressed: %s", count, fmt);
+}
+
+// called by the writer thread, so a storm that simply stops still gets its
+// count reported once the window is over.
+void Logger::flush_suppressed(int64_t now) {
+  for (auto &limit : limits_) {
+    const char *fmt = limit.fmt.load(std::memory_order_acquire);
+    if (!fmt) {
+      continue;
+    }
+    if (limit.suppressed.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+    uint32_t suppressed = roll_window(limit, now);
+    if (suppressed) {
+      report_suppressed(fmt, now, suppressed);
+    }
+  }
+}
+
+bool Logger::has_suppressed() const {
+  for (const auto &limit : limits_) {
+    if (limit.suppressed.load(std::memory_order_relaxed) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// something for the writer to do: a published line or a drop to report.
+bool Logger::ready() const {
+  return slots_[tail_ % LOG_RING_SIZE].seq.load(std::memory_order_acquire) ==
+             tail_ + 1 ||
+         dropped_.load(std::memory_order_relaxed) > 0;
+}
+
+void Logger::wake() {
+  // pairs with the fence in writer_loop, either the writer sees what was
+  // published before it sleeps or this sees it sleeping.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_.notify_one();
+  }
+}
+
+void Logger::write_sink(const char *data, int len) {
+  if (write(fd_, data, len) < 0) {
+    // nowhere left to report it
+  }
+}
+
+void Logger::log(LogLevel level, const char *fmt, ...) {
+  if (level < level_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  int64_t now = now_ms();
+  uint32_t suppressed;
+  if (!allow(fmt, now, suppressed)) {
+    return;
+  }
+  if (suppressed) {
+    report_suppressed(fmt, now, suppressed);
+  }
+
+  char text[LOG_LINE_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  push(level, now, "%s", text);
+}
+
+// bounded MPMC queue after Dmitry Vyukov, every slot carries the sequence
+// number telling whether it's free for the producer at `pos`.
+bool Logger::push(LogLevel level, int64_t time_ms, const char *fmt, ...) {
+  uint64_t pos = head_.load(std::memory_order_relaxed);
+  Slot *slot;
+  while (true) {
+    slot = &slots_[pos % LOG_RING_SIZE];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    auto diff = static_cast<int64_t>(seq - pos);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      wake();
+      return false;
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->level = level;
+  slot->time_ms = time_ms;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+  va_end(args);
+  slot->seq.store(pos + 1, std::memory_order_release);
+  wake();
+  return true;
+}
+
+// writes everything published so far, returns false if there was nothing.
+// write(2) instead of stdio, a fork must never catch this thread holding the
+// stderr lock.
+bool Logger::drain() {
+  bool any = false;
+  char line[LOG_LINE_SIZE + 64];
+  while (true) {
+    Slot &slot = slots_[tail_ % LOG_RING_SIZE];
+    if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) {
+      break;
+    }
+
+    time_t seconds = slot.time_ms / 1000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    int len = snprintf(line, sizeof(line),
+                       "%04d-%02d-%02d %02d:%02d:%02d.%03d [%s] %s\n",
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                       tm.tm_min, tm.tm_sec, static_cast<int>(slot.time_ms % 1000),
+                       level_name(slot.level), slot.text);
+    slot.seq.store(tail_ + LOG_RING_SIZE, std::memory_order_release);
+    ++tail_;
+
+    if (len > static_cast<int>(sizeof(line)) - 1) {
+      len = sizeof(line) - 1;
+      line[len - 1] = '\n';
+    }
+    write_sink(line, len);
+    any = true;
+  }
+
+  uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+  if (dropped) {
+    int len = snprintf(line, sizeof(line),
+                       "[WARN] log ring full, %llu lines dropped\n",
+                       static_cast<unsigned long long>(dropped));
+    write_sink(line, len);
+  }
+  written_.store(tail_, std::memory_order_release);
+  return any;
+}
+
+void Logger::writer_loop() {
+  int64_t last_check = now_ms();
+  while (running_.load(std::memory_order_relaxed)) {
+    int64_t now = now_ms();
+    if (now - last_check >= LOG_RATE_WINDOW_MS / 10) {
+      flush_suppressed(now);
+      last_check = now;
+    }
+    if (drain()) {
+      continue;
+    }
+
+    // idle: block until a producer publishes something. while counts are
+    // pending, wake up anyway to report them once their window is over.
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto busy = [this] {
+      return !running_.load(std::memory_order_relaxed) || ready();
+    };
+    if (has_suppressed()) {
+      wake_.wait_for(lock,
+                     std::chrono::milliseconds(LOG_RATE_WINDOW_MS / 10), busy);
+    } else {
+      wake_.wait(lock, [&] { return busy() || has_suppressed(); });
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+  flush_suppressed(now_ms() + LOG_RATE_WINDOW_MS);
+  drain();
+}
+
+void Logger::flush() {
+  uint64_t target = head_.load(std::memory_order_acquire);
+  while (written_.load(std::memory_order_acquire) < target &&
+         writer_.joinable()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
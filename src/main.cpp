@@ -1,27 +1,121 @@
 #include "server.hpp"
 
+#include <cctype>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 const int DEFAULT_PORT = 3000;
 
-int main(int argc, char *argv[]) {
-  int port = DEFAULT_PORT;
-  if (argc > 1) {
+static void usage() {
+  std::cerr << "usage: database [port] [--port n] [--maxclients n] "
+               "[--timeout seconds]\n"
+               "                [--loglevel debug|info|warn|error]\n"
+               "                [--output-limit hard soft seconds] "
+               "[--pubsub-output-limit hard soft seconds]\n"
+               "sizes are bytes or take a kb, mb or gb suffix, 0 disables "
+               "a limit"
+            << std::endl;
+}
+
+// "64mb" -> 67108864
+static size_t parse_bytes(const std::string &str) {
+  size_t pos;
+  unsigned long long number = std::stoull(str, &pos);
+  std::string unit = str.substr(pos);
+  for (char &c : unit) {
+    c = tolower(c);
+  }
+  if (unit == "kb") {
+    return number * 1024;
+  } else if (unit == "mb") {
+    return number * 1024 * 1024;
+  } else if (unit == "gb") {
+    return number * 1024 * 1024 * 1024;
+  } else if (!unit.empty() && unit != "b") {
+    throw std::invalid_argument("unknown unit " + unit);
+  }
+  return number;
+}
+
+static bool parse_config(int argc, char *argv[], ServerConfig &config) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    // number of values the option takes
+    int values = 1;
+    if (arg == "--output-limit" || arg == "--pubsub-output-limit") {
+      values = 3;
+    } else if (arg.rfind("--", 0) != 0) {
+      values = 0;
+    }
+    if (i + values >= argc) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return false;
+    }
+
     try {
-      port = std::stoul(argv[1]);
+      if (values == 0) {
+        config.port = std::stoul(arg);
+      } else if (arg == "--port") {
+        config.port = std::stoul(argv[++i]);
+      } else if (arg == "--maxclients") {
+        config.maxclients = std::stoul(argv[++i]);
+      } else if (arg == "--timeout") {
+        config.timeout = std::stoul(argv[++i]);
+      } else if (arg == "--loglevel") {
+        std::string level = argv[++i];
+        if (level == "debug") {
+          config.loglevel = LogLevel::DEBUG;
+        } else if (level == "info") {
+          config.loglevel = LogLevel::INFO;
+        } else if (level == "warn") {
+          config.loglevel = LogLevel::WARN;
+        } else if (level == "error") {
+          config.loglevel = LogLevel::ERROR;
+        } else {
+          throw std::invalid_argument(level);
+        }
+      } else if (values == 3) {
+        OutputLimit &limit = arg == "--output-limit"
+                                 ? config.client_output_limit
+                                 : config.pubsub_output_limit;
+        limit.hard_bytes = parse_bytes(argv[++i]);
+        limit.soft_bytes = parse_bytes(argv[++i]);
+        limit.soft_seconds = std::stoul(argv[++i]);
+      } else {
+        std::cerr << "unknown option " << arg << std::endl;
+        return false;
+      }
     } catch (const std::exception &e) {
-      std::cerr << "Invalid port number. Using default " << DEFAULT_PORT
-                << std::endl;
+      std::cerr << "invalid value for " << arg << std::endl;
+      return false;
     }
   }
 
+  if (config.maxclients == 0) {
+    std::cerr << "maxclients has to be at least 1" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  ServerConfig config;
+  config.port = DEFAULT_PORT;
+  if (!parse_config(argc, argv, config)) {
+    usage();
+    return 1;
+  }
+
   try {
-    DatabaseServer server(port);
+    DatabaseServer server(config);
     server.run();
+    // run() only returns when the server could not start or the event loop
+    // failed, make sure the reason is written before exiting.
+    Logger::instance().flush();
+    return 1;
   } catch (const std::exception &e) {
     std::cerr << "Server error: " << e.what() << std::endl;
     return 1;
   }
-
-  return 0;
 }
@@ -0,0 +1,91 @@
+#include "output_buffer.hpp"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <utility>
+
+void OutputBuffer::append(std::string_view data) {
+  if (data.empty()) {
+    return;
+  }
+  // never grow the chunk that is being sent, its sent prefix is only
+  // released once the whole chunk is gone.
+  if (chunks_.empty() || chunks_.back().shared ||
+      (chunks_.size() == 1 && offset_ > 0) ||
+      chunks_.back().owned.size() >= OUTPUT_CHUNK_SIZE) {
+    chunks_.emplace_back();
+  }
+  chunks_.back().owned.append(data);
+  size_ += data.size();
+}
+
+void OutputBuffer::append(const Blob &blob) {
+  if (!blob || blob->empty()) {
+    return;
+  }
+  if (blob->size() < ZERO_COPY_THRESHOLD) {
+    append(std::string_view(*blob));
+    return;
+  }
+  append_shared(blob);
+}
+
+void OutputBuffer::append_shared(const Blob &blob) {
+  if (!blob || blob->empty()) {
+    return;
+  }
+  Chunk chunk;
+  chunk.shared = blob;
+  chunks_.push_back(std::move(chunk));
+  size_ += blob->size();
+}
+
+bool OutputBuffer::empty() const { return size_ == 0; }
+
+size_t OutputBuffer::size() const { return size_; }
+
+size_t OutputBuffer::retained() const {
+  size_t bytes = 0;
+  for (const auto &chunk : chunks_) {
+    bytes += chunk.view().size();
+  }
+  return bytes;
+}
+
+int OutputBuffer::fill_iov(struct iovec *iov, int max) const {
+  int count = 0;
+  size_t skip = offset_;
+  for (auto it = chunks_.begin(); it != chunks_.end() && count < max; ++it) {
+    std::string_view data = it->view().substr(skip);
+    skip = 0;
+    iov[count].iov_base = const_cast<char *>(data.data());
+    iov[count].iov_len = data.size();
+    ++count;
+  }
+  return count;
+}
+
+void OutputBuffer::consume(size_t bytes) {
+  size_ -= bytes;
+  while (bytes > 0) {
+    size_t remaining = chunks_.front().view().size() - offset_;
+    if (bytes < remaining) {
+      offset_ += bytes;
+      return;
+    }
+    bytes -= remaining;
+    offset_ = 0;
+    chunks_.pop_front();
+  }
+}
+
+std::string OutputBuffer::str() const {
+  std::string out;
+  out.reserve(size_);
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    out.append(chunks_[i].view().substr(i == 0 ? offset_ : 0));
+  }
+  return out;
+}
@@ -1,25 +1,48 @@
+#include <cctype>
 #include <optional>
-#include <sstream>
+#include <string_view>
 
 #include "parser.hpp"
 
-std::optional<Command> Parser::parse(const std::string &input) {
-  std::stringstream ss(input);
-  std::istream_iterator<std::string> begin(ss);
-  std::istream_iterator<std::string> end;
-  std::vector<std::string> tokens(begin, end);
+static bool is_space(char c) {
+  return std::isspace(static_cast<unsigned char>(c));
+}
+
+// tokenizes in place on the view, so the only allocations are the tokens
+// themselves.
+std::optional<Command> Parser::parse(std::string_view input) {
+  Command cmd;
+  bool has_name = false;
+
+  size_t pos = 0;
+  while (pos < input.size()) {
+    while (pos < input.size() && is_space(input[pos])) {
+      ++pos;
+    }
+    size_t start = pos;
+    while (pos < input.size() && !is_space(input[pos])) {
+      ++pos;
+    }
+    if (start == pos) {
+      break;
+    }
 
-  if (tokens.empty()) {
+    std::string_view token = input.substr(start, pos - start);
+    if (!has_name) {
+      cmd.name.assign(token);
+      has_name = true;
+    } else {
+      cmd.args.emplace_back(token);
+    }
+  }
+
+  if (!has_name) {
     return std::nullopt;
   }
 
-  Command cmd;
-  cmd.name = tokens[0];
   for (char &c : cmd.name) {
     c = toupper(c);
   }
 
-  cmd.args.assign(tokens.begin() + 1, tokens.end());
-
   return cmd;
 }
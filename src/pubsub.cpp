@@ -0,0 +1,202 @@
+#include "pubsub.hpp"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// matches a single [...] class at the start of `pattern` against `c` and
+// advances `pattern` past it.
+static bool match_class(std::string_view &pattern, char c) {
+  size_t pos = 1;
+  bool negate = pos < pattern.size() && pattern[pos] == '^';
+  if (negate) {
+    ++pos;
+  }
+  bool matched = false;
+  while (pos < pattern.size() && pattern[pos] != ']') {
+    if (pattern[pos] == '\\' && pos + 1 < pattern.size()) {
+      ++pos;
+      matched |= pattern[pos] == c;
+    } else if (pos + 2 < pattern.size() && pattern[pos + 1] == '-' &&
+               pattern[pos + 2] != ']') {
+      char low = pattern[pos], high = pattern[pos + 2];
+      if (low > high) {
+        std::swap(low, high);
+      }
+      matched |= c >= low && c <= high;
+      pos += 2;
+    } else {
+      matched |= pattern[pos] == c;
+    }
+    ++pos;
+  }
+  pattern.remove_prefix(pos < pattern.size() ? pos + 1 : pos);
+  return matched != negate;
+}
+
+bool glob_match(std::string_view pattern, std::string_view str) {
+  // position to retry from after the last '*', if any
+  std::string_view star_pattern, star_str;
+  bool has_star = false;
+
+  while (!str.empty()) {
+    if (!pattern.empty() && pattern[0] == '*') {
+      pattern.remove_prefix(1);
+      star_pattern = pattern;
+      star_str = str;
+      has_star = true;
+      continue;
+    }
+
+    bool matched = false;
+    if (!pattern.empty()) {
+      if (pattern[0] == '?') {
+        pattern.remove_prefix(1);
+        matched = true;
+      } else if (pattern[0] == '[') {
+        matched = match_class(pattern, str[0]);
+      } else {
+        if (pattern[0] == '\\' && pattern.size() > 1) {
+          pattern.remove_prefix(1);
+        }
+        matched = pattern[0] == str[0];
+        pattern.remove_prefix(1);
+      }
+    }
+
+    if (matched) {
+      str.remove_prefix(1);
+      continue;
+    }
+    if (!has_star) {
+      return false;
+    }
+    // let the last '*' swallow one more character and retry
+    star_str.remove_prefix(1);
+    str = star_str;
+    pattern = star_pattern;
+  }
+
+  while (!pattern.empty() && pattern[0] == '*') {
+    pattern.remove_prefix(1);
+  }
+  return pattern.empty();
+}
+
+size_t PubSub::subscribe(int fd, const std::string &channel) {
+  auto &client = clients_[fd];
+  if (client.channels.insert(channel).second) {
+    channels_[channel].insert(fd);
+  }
+  return client.channels.size() + client.patterns.size();
+}
+
+size_t PubSub::unsubscribe(int fd, const std::string &channel) {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return 0;
+  }
+  if (client->second.channels.erase(channel)) {
+    auto it = channels_.find(channel);
+    it->second.erase(fd);
+    if (it->second.empty()) {
+      channels_.erase(it);
+    }
+  }
+  size_t count = client->second.channels.size() + client->second.patterns.size();
+  if (count == 0) {
+    clients_.erase(client);
+  }
+  return count;
+}
+
+size_t PubSub::psubscribe(int fd, const std::string &pattern) {
+  auto &client = clients_[fd];
+  if (client.patterns.insert(pattern).second) {
+    patterns_[pattern].insert(fd);
+  }
+  return client.channels.size() + client.patterns.size();
+}
+
+size_t PubSub::punsubscribe(int fd, const std::string &pattern) {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return 0;
+  }
+  if (client->second.patterns.erase(pattern)) {
+    auto it = patterns_.find(pattern);
+    it->second.erase(fd);
+    if (it->second.empty()) {
+      patterns_.erase(it);
+    }
+  }
+  size_t count = client->second.channels.size() + client->second.patterns.size();
+  if (count == 0) {
+    clients_.erase(client);
+  }
+  return count;
+}
+
+std::vector<std::string> PubSub::channels(int fd) const {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return {};
+  }
+  return {client->second.channels.begin(), client->second.channels.end()};
+}
+
+std::vector<std::string> PubSub::patterns(int fd) const {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return {};
+  }
+  return {client->second.patterns.begin(), client->second.patterns.end()};
+}
+
+size_t PubSub::subscriptions(int fd) const {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return 0;
+  }
+  return client->second.channels.size() + client->second.patterns.size();
+}
+
+void PubSub::remove(int fd) {
+  for (const auto &channel : channels(fd)) {
+    unsubscribe(fd, channel);
+  }
+  for (const auto &pattern : patterns(fd)) {
+    punsubscribe(fd, pattern);
+  }
+}
+
+size_t PubSub::publish(const std::string &channel, const std::string &message,
+                       const Deliver &deliver) {
+  size_t receivers = 0;
+
+  auto subscribers = channels_.find(channel);
+  if (subscribers != channels_.end()) {
+    // encoded once, every subscriber queues a reference
+    Blob encoded = make_blob("message " + channel + " " + message + "\n");
+    for (int fd : subscribers->second) {
+      deliver(fd, encoded);
+      ++receivers;
+    }
+  }
+
+  for (const auto &pattern : patterns_) {
+    if (!glob_match(pattern.first, channel)) {
+      continue;
+    }
+    Blob encoded = make_blob("pmessage " + pattern.first + " " + channel +
+                             " " + message + "\n");
+    for (int fd : pattern.second) {
+      deliver(fd, encoded);
+      ++receivers;
+    }
+  }
+
+  return receivers;
+}
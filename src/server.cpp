@@ -1,65 +1,192 @@
 #include "server.hpp"
+#include "lazy_free.hpp"
+#include "logger.hpp"
 #include "storage.hpp"
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
-#include <iostream>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <sys/event.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 void set_non_blocking(int sock) {
   if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
-    perror("fcntl F_SETFL");
+    LOG_ERROR("fcntl F_SETFL: %s", strerror(errno));
   }
 }
 
-/* add a new connection storing the IP address */
+/* best effort write to a socket that is about to be closed. it must not
+ * raise SIGPIPE if the peer is already gone. */
+static void send_and_forget(int fd, const char *message) {
+  int flags = MSG_DONTWAIT;
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+  if (send(fd, message, strlen(message), flags) < 0) {
+    // the connection is dropped either way
+  }
+}
+
+/* take a free slot of the client table for a new connection */
 int DatabaseServer::conn_add(int fd) {
-  uint uidx;
   if (fd < 1) {
     return -1;
   }
-  if (users_.size() >= USER_AMOUNT) {
-    // TODO error handling too many concurrent clients
+  if (free_slots_.empty()) {
+    ++stats_->rejected_connections;
+    send_and_forget(fd, "ERROR: max number of clients reached\n");
     close(fd);
     return -1;
   }
-  uc new_client = {fd, 0};
-  users_.emplace(fd, std::move(new_client));
+  uint32_t slot = free_slots_.back();
+  free_slots_.pop_back();
+  if (static_cast<size_t>(fd) >= fd_slots_.size()) {
+    fd_slots_.resize(fd + 1, -1);
+  }
+  fd_slots_[fd] = slot;
+
+  uc &client_info = clients_[slot];
+  client_info.uc_fd = fd;
+  client_info.id = next_client_id_++;
+  client_info.last_active_ms = now_ms_;
+  if (config_.timeout > 0) {
+    idle_wheel_.schedule(fd, client_info.id,
+                         config_.timeout * 1000 / TIMER_TICK_MS);
+  }
+  ++stats_->total_connections;
+  stats_->connected_clients = clients_.size() - free_slots_.size();
   return 0;
 }
 
 /* remove a connection and close it's fd */
 int DatabaseServer::conn_delete(int fd) {
-  int uidx;
-  if (fd < 1)
-    return -1;
-  auto it = users_.find(fd);
-  if (it == users_.end()) {
+  uc *client_info = client(fd);
+  if (!client_info) {
     return -1;
   }
-  users_.erase(it);
-  /* free(users_[uidx].uc_addr); */
+  unwatch_all(*client_info);
+  pubsub_.remove(fd);
+  tracking_.disable(fd);
+  free_slots_.push_back(fd_slots_[fd]);
+  fd_slots_[fd] = -1;
+  // a free slot keeps no buffers around
+  *client_info = uc();
+  stats_->connected_clients = clients_.size() - free_slots_.size();
+  // closing the fd drops its filters, pending changes must not outlive it
+  // or they would hit the next connection that reuses the number.
+  for (size_t i = 0; i < pending_close_.size(); ++i) {
+    if (pending_close_[i] == fd) {
+      pending_close_[i] = pending_close_.back();
+      pending_close_.pop_back();
+      break;
+    }
+  }
+  for (size_t i = 0; i < changes_.size();) {
+    if (changes_[i].ident == static_cast<uintptr_t>(fd)) {
+      changes_[i] = changes_.back();
+      changes_.pop_back();
+    } else {
+      ++i;
+    }
+  }
   return close(fd);
 }
 
-DatabaseServer::DatabaseServer(int port) : port_(port) {
-  storage_ = std::make_shared<Storage>();
-  commandHandler_ = std::make_unique<CommandHandler>(storage_);
+uc *DatabaseServer::client(int fd) {
+  if (fd < 0 || static_cast<size_t>(fd) >= fd_slots_.size() ||
+      fd_slots_[fd] < 0) {
+    return nullptr;
+  }
+  return &clients_[fd_slots_[fd]];
+}
+
+/* mark a connection to be closed once the current batch of events is done,
+ * so no caller is left holding a reference to a deleted client. */
+void DatabaseServer::close_later(int fd, uc &client_info) {
+  if (!client_info.closing) {
+    client_info.closing = true;
+    pending_close_.push_back(fd);
+  }
+}
+
+/* queue a filter change, submitted with the next kevent() wait */
+void DatabaseServer::queue_change(int fd, int16_t filter, uint16_t flags) {
+  struct kevent event;
+  EV_SET(&event, fd, filter, flags, 0, 0, NULL);
+  changes_.push_back(event);
+}
+
+DatabaseServer::DatabaseServer(const ServerConfig &config) : config_(config) {
+  Logger::instance().set_level(config_.loglevel);
+  storage_ = std::make_shared<Storage>(std::make_shared<LazyFree>());
+  stats_ = std::make_shared<Stats>();
+  commandHandler_ = std::make_unique<CommandHandler>(storage_, stats_);
+  deliver_ = [this](int fd, const Blob &message) { deliver(fd, message); };
+  storage_->setKeyListener(
+      [this](const std::string &key) { tracking_.key_changed(key, deliver_); });
+}
+
+/* every client needs an fd, lower maxclients if the open file limit can't be
+ * raised far enough. */
+void DatabaseServer::raise_fd_limit() {
+  rlim_t wanted = static_cast<rlim_t>(config_.maxclients) + RESERVED_FDS;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    LOG_WARN("getrlimit: %s", strerror(errno));
+    return;
+  }
+  rlim_t current = limit.rlim_cur;
+  if (current >= wanted) {
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max == RLIM_INFINITY
+                       ? wanted
+                       : std::min(wanted, limit.rlim_max);
+  if (setrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    current = limit.rlim_cur;
+  }
+  if (current < wanted) {
+    uint32_t maxclients =
+        current > RESERVED_FDS ? static_cast<uint32_t>(current - RESERVED_FDS)
+                               : 1;
+    LOG_WARN("open file limit is %llu, maxclients lowered from %u to %u",
+             static_cast<unsigned long long>(current), config_.maxclients,
+             maxclients);
+    config_.maxclients = maxclients;
+  }
 }
 
 // kevent thx to https://eradman.com/posts/kqueue-tcp.html
 void DatabaseServer::run() {
-  users_.reserve(USER_AMOUNT);
+  raise_fd_limit();
+  // the whole client table is allocated up front, memory doesn't depend on
+  // how connections come and go.
+  clients_.resize(config_.maxclients);
+  free_slots_.reserve(config_.maxclients);
+  for (uint32_t slot = config_.maxclients; slot > 0; --slot) {
+    free_slots_.push_back(slot - 1);
+  }
+  fd_slots_.assign(config_.maxclients + RESERVED_FDS, -1);
+  stats_->maxclients = config_.maxclients;
+  changes_.reserve(EVENT_AMOUNT);
   addrinfo *address;
   addrinfo hints;
   memset(&hints, 0, sizeof(hints));
@@ -70,10 +197,10 @@ void DatabaseServer::run() {
   // have to use fcntl since O_NONBLOCK does not work here.
   hints.ai_socktype = SOCK_STREAM;
   int error =
-      getaddrinfo("127.0.0.1", std::to_string(port_).c_str(), &hints, &address);
+      getaddrinfo("127.0.0.1", std::to_string(config_.port).c_str(), &hints, &address);
 
   if (error) {
-    std::cerr << "getaddrinfo: " << gai_strerror(error) << std::endl;
+    LOG_ERROR("getaddrinfo: %s", gai_strerror(error));
     return;
   }
 
@@ -82,22 +209,22 @@ void DatabaseServer::run() {
   // use fcntl to make server_fd non-blocking.
   set_non_blocking(server_fd);
   if (server_fd == -1) {
-    std::cerr << "Failed to create socket" << std::endl;
+    LOG_ERROR("Failed to create socket");
     return;
   }
 
   if (bind(server_fd, address->ai_addr, address->ai_addrlen) < 0) {
-    std::cerr << "Bind failed" << std::endl;
+    LOG_ERROR("Bind failed");
     close(server_fd);
     return;
   }
 
   if (listen(server_fd, SOMAXCONN) < 0) {
-    std::cerr << "Listen failed" << std::endl;
+    LOG_ERROR("Listen failed");
     close(server_fd);
     return;
   }
-  std::cout << "Server listening on port " << port_ << std::endl;
+  LOG_INFO("Server listening on port %d", config_.port);
 
   struct kevent event;
   struct kevent tevent[EVENT_AMOUNT];
@@ -105,172 +232,540 @@ void DatabaseServer::run() {
 
   kq_ = kqueue();
   if (kq_ < 0) {
-    std::cerr << "kqueue() failed" << std::endl;
+    LOG_ERROR("kqueue() failed");
     return;
   }
 
   EV_SET(&event, server_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
   if (kevent(kq_, &event, 1, NULL, 0, NULL) < 0) {
-    std::cerr << "kevent failed" << std::endl;
+    LOG_ERROR("kevent failed");
     return;
   }
+  // idle clients are reaped by a periodic tick, data is the period in ms
+  if (config_.timeout > 0) {
+    EV_SET(&event, 0, EVFILT_TIMER, EV_ADD, 0, TIMER_TICK_MS, NULL);
+    if (kevent(kq_, &event, 1, NULL, 0, NULL) < 0) {
+      LOG_ERROR("kevent timer failed");
+      return;
+    }
+  }
 
   int fd;
   sockaddr_storage addr;
-  socklen_t socklen = sizeof(addr);
+  socklen_t socklen;
   while (true) {
-    nev = kevent(kq_, NULL, 0, tevent, EVENT_AMOUNT, NULL);
-
-    if (nev < 1) {
-      std::cerr << "kevent wait failed" << std::endl;
+    // every filter change queued while handling the previous batch is
+    // submitted together with the wait, so a loop iteration costs a single
+    // kevent() no matter how many clients were served.
+    // while a SAVE child runs the wait times out, so the child is reaped
+    // and its duration recorded soon after it exits.
+    timespec save_poll = {0, SAVE_POLL_MS * 1000000};
+    nev = kevent(kq_, changes_.data(), changes_.size(), tevent, EVENT_AMOUNT,
+                 commandHandler_->saving() ? &save_poll : NULL);
+    changes_.clear();
+
+    if (nev < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nev < 0) {
+      LOG_ERROR("kevent wait failed");
       return;
     }
+    commandHandler_->reap_save();
+    if (nev == 0) {
+      continue;
+    }
+    auto iteration_start = std::chrono::steady_clock::now();
+    now_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  iteration_start.time_since_epoch())
+                  .count();
 
     for (int i = 0; i < nev; ++i) {
       fd = tevent[i].ident;
 
+      if (tevent[i].filter == EVFILT_TIMER) {
+        // data counts the ticks since the last delivery
+        intptr_t ticks = std::min<intptr_t>(tevent[i].data, TIMER_WHEEL_SLOTS);
+        for (; ticks > 0; --ticks) {
+          idle_wheel_.tick(
+              [this](int fd, uint64_t id) { reap_idle(fd, id); });
+        }
+        continue;
+      }
+
       if (tevent[i].flags & EV_ERROR) {
-        std::cerr << "event error: " << event.data << std::endl;
+        // a rejected change, the client can't be served without its filters.
+        LOG_WARN("event error on %d: %s", fd,
+                 strerror(static_cast<int>(tevent[i].data)));
+        if (fd != server_fd) {
+          conn_delete(fd);
+        }
         continue;
       }
 
       if (tevent[i].flags & EV_EOF) {
-        std::cerr << "client " << fd << " disconnected" << std::endl;
-        struct kevent changelist[2];
-        EV_SET(&changelist[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-        EV_SET(&changelist[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-        if (kevent(kq_, changelist, 2, NULL, 0, NULL) < 0) {
-          perror("EV_EOF");
-        }
+        LOG_INFO("client %d disconnected", fd);
         conn_delete(fd);
         continue;
       }
 
       if (fd == server_fd) {
-        // macos does not know accept4, so no O_NONBLOCK OR SOCK_NONBLOCK
-        fd = accept(tevent[i].ident, reinterpret_cast<struct sockaddr *>(&addr),
-                    &socklen);
-        if (fd < 0) {
-          perror("accept");
-          continue;
-        }
-        // need to set non blocking explicitly.
-        set_non_blocking(fd);
-        if (conn_add(fd) == 0) {
-          users_[fd].write_buffer = "Welcome\n";
-          struct kevent changelist[2];
-          EV_SET(&changelist[0], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-          // enable for the welcome message
-          EV_SET(&changelist[1], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
-          if (kevent(kq_, &changelist[0], 2, NULL, 0, NULL) == -1) {
-            perror("onboard client");
-            conn_delete(fd);
+        // drain the whole backlog, data holds its length.
+        for (intptr_t backlog = tevent[i].data; backlog > 0; --backlog) {
+          socklen = sizeof(addr);
+          // macos does not know accept4, so no O_NONBLOCK OR SOCK_NONBLOCK
+          fd = accept(server_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                      &socklen);
+          if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+              LOG_ERROR("accept: %s", strerror(errno));
+            }
+            break;
+          }
+          // need to set non blocking explicitly.
+          set_non_blocking(fd);
+          if (conn_add(fd) == 0) {
+            LOG_DEBUG("client %d connected", fd);
+            queue_change(fd, EVFILT_READ, EV_ADD);
+            queue_change(fd, EVFILT_WRITE, EV_ADD | EV_DISABLE);
+            auto &client_info = *client(fd);
+            client_info.write_buffer.append("Welcome\n");
+            flush_client(fd, client_info);
+          } else {
+            LOG_WARN("connection refused, maxclients (%u) reached",
+                     config_.maxclients);
           }
-        } else {
-          printf("connection refused\n");
-          close(fd);
         }
         continue;
       }
-      if (tevent[i].filter & EVFILT_WRITE) {
-        handle_client_write(tevent[i].ident);
-      }
-      if (tevent[i].filter & EVFILT_READ) {
-        handle_client_read(tevent[i].ident);
+      if (tevent[i].filter == EVFILT_WRITE) {
+        handle_client_write(fd);
+      } else if (tevent[i].filter == EVFILT_READ) {
+        handle_client_read(fd);
       }
     }
+
+    while (!pending_close_.empty()) {
+      conn_delete(pending_close_.back());
+    }
+
+    stats_->record_loop_iteration(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - iteration_start)
+            .count());
   }
 }
 
-void DatabaseServer::handle_client_write(int client_socket) {
-  auto client = users_.find(client_socket);
-  if (client == users_.end()) {
-    perror("find user");
-    return;
-  }
+/* send as much as the socket takes right away, EVFILT_WRITE is only enabled
+ * while something is left over. returns false if the client was dropped. */
+bool DatabaseServer::flush_client(int fd, uc &client_info) {
+  while (!client_info.write_buffer.empty()) {
+    // large values are still referenced from the store, writev gathers them
+    // together with the small replies around them.
+    struct iovec iov[IOV_AMOUNT];
+    int iovcnt = client_info.write_buffer.fill_iov(iov, IOV_AMOUNT);
+    auto sent = writev(fd, iov, iovcnt);
+
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // buffer is full. try again later.
+        break;
+      }
+      LOG_WARN("writev: %s", strerror(errno));
+      close_later(fd, client_info);
+      return false;
+    }
 
-  auto &client_info = client->second;
+    client_info.write_buffer.consume(sent);
+    client_info.last_active_ms = now_ms_;
+    stats_->bytes_out += sent;
+  }
 
-  auto sent = send(client_socket, client_info.write_buffer.c_str(),
-                   client_info.write_buffer.length(), 0);
+  if (!enforce_output_limit(fd, client_info)) {
+    return false;
+  }
+  set_write_interest(fd, client_info, !client_info.write_buffer.empty());
+  return true;
+}
 
-  if (sent < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      // buffer is full. try again later.
-      return;
+/* disconnect a client whose pending output broke the hard limit or stayed
+ * above the soft limit for too long. returns false if it's being closed. */
+bool DatabaseServer::enforce_output_limit(int fd, uc &client_info) {
+  size_t pending = client_info.write_buffer.size();
+  if (pending == 0) {
+    client_info.soft_limit_since_ms = 0;
+    return true;
+  }
+  const OutputLimit &limit = pubsub_.subscriptions(fd) > 0
+                                 ? config_.pubsub_output_limit
+                                 : config_.client_output_limit;
+
+  bool exceeded = limit.hard_bytes > 0 && pending > limit.hard_bytes;
+  if (limit.soft_bytes > 0 && pending > limit.soft_bytes) {
+    if (client_info.soft_limit_since_ms == 0) {
+      client_info.soft_limit_since_ms = now_ms_;
     }
-    perror("send");
-    conn_delete(client_socket);
+    exceeded |= now_ms_ - client_info.soft_limit_since_ms >=
+                static_cast<uint64_t>(limit.soft_seconds) * 1000;
+  } else {
+    client_info.soft_limit_since_ms = 0;
+  }
+  if (!exceeded) {
+    return true;
+  }
+
+  LOG_WARN("client %d exceeded its output buffer limit with %zu bytes pending",
+           fd, pending);
+  ++stats_->output_limit_disconnections;
+  close_later(fd, client_info);
+  return false;
+}
+
+/* timer wheel callback. closes the client if it stayed silent for the whole
+ * timeout, otherwise checks again when it would run out. */
+void DatabaseServer::reap_idle(int fd, uint64_t id) {
+  uc *client_info = client(fd);
+  // closed in the meantime, or the fd belongs to a newer connection now
+  if (!client_info || client_info->id != id || client_info->closing) {
     return;
   }
+  uint64_t timeout_ms = static_cast<uint64_t>(config_.timeout) * 1000;
+  uint64_t idle_ms = now_ms_ - client_info->last_active_ms;
+  // subscribers only listen, they never time out
+  if (idle_ms >= timeout_ms && pubsub_.subscriptions(fd) == 0) {
+    LOG_INFO("client %d timed out", fd);
+    ++stats_->timed_out_clients;
+    close_later(fd, *client_info);
+    return;
+  }
+  uint64_t left_ms = idle_ms >= timeout_ms ? timeout_ms : timeout_ms - idle_ms;
+  idle_wheel_.schedule(fd, id, (left_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+}
 
-  if (sent < client_info.write_buffer.length()) {
-    client_info.write_buffer.erase(0, sent);
-  } else {
-    client_info.write_buffer.clear();
+void DatabaseServer::set_write_interest(int fd, uc &client_info, bool enable) {
+  if (enable != client_info.write_enabled) {
+    queue_change(fd, EVFILT_WRITE, enable ? EV_ENABLE : EV_DISABLE);
+    client_info.write_enabled = enable;
   }
+}
 
-  if (client_info.write_buffer.empty()) {
-    struct kevent event;
-    EV_SET(&event, client_socket, EVFILT_WRITE, EV_DISABLE, 0, 0, NULL);
-    if (kevent(kq_, &event, 1, NULL, 0, NULL) < 0) {
-      std::cerr << "disable kevent write" << std::endl;
-      conn_delete(client_socket);
-    }
+void DatabaseServer::handle_client_write(int client_socket) {
+  uc *client_info = client(client_socket);
+  if (!client_info || client_info->closing) {
+    return;
   }
+
+  flush_client(client_socket, *client_info);
 }
 
 void DatabaseServer::handle_client_read(int client_socket) {
-  auto client = users_.find(client_socket);
-  if (client == users_.end()) {
-    perror("find user");
+  uc *client_ptr = client(client_socket);
+  if (!client_ptr || client_ptr->closing) {
     return;
   }
-  char buffer[1024] = {0};
+  char buffer[READ_BUFFER_SIZE];
 
-  int bytes_read = recv(client_socket, buffer, 1024, MSG_DONTWAIT);
-  if (bytes_read <= 0) {
+  auto bytes_read = recv(client_socket, buffer, READ_BUFFER_SIZE, MSG_DONTWAIT);
+  if (bytes_read == 0) {
+    LOG_INFO("Client %d disconnected (read 0 bytes).", client_socket);
+    conn_delete(client_socket);
+    return;
+  }
+  if (bytes_read < 0) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
       return;
-    } else if (bytes_read == 0) {
-      std::cout << "Client " << client_socket << " disconnected (read 0 bytes)."
-                << std::endl;
-    } else {
-      perror("read");
     }
+    LOG_WARN("read: %s", strerror(errno));
     conn_delete(client_socket);
     return;
   }
 
-  users_[client_socket].read_buffer.append(buffer, bytes_read);
+  stats_->bytes_in += bytes_read;
+  auto &client_info = *client_ptr;
+  client_info.last_active_ms = now_ms_;
+  client_info.read_buffer.append(buffer, bytes_read);
 
+  // commands are parsed straight out of the read buffer and replies are
+  // written into the write buffer, the consumed prefix is dropped once.
+  std::string_view pending(client_info.read_buffer);
+  size_t consumed = 0;
+  bool replied = false;
   while (true) {
-    auto pos = users_[client_socket].read_buffer.find('\n');
-    if (pos == std::string::npos) {
-      return;
+    auto pos = pending.find('\n', consumed);
+    if (pos == std::string_view::npos) {
+      break;
     }
 
-    std::string command = users_[client_socket].read_buffer.substr(0, pos);
-    users_[client_socket].read_buffer.erase(0, pos + 1);
+    std::string_view command = pending.substr(consumed, pos - consumed);
+    consumed = pos + 1;
 
     if (command.empty()) {
       continue;
     }
     auto command_opt = parser_.parse(command);
 
-    std::string response;
     if (command_opt) {
-      response = commandHandler_->handle(*command_opt);
+      run_command(client_info, std::move(*command_opt));
     } else {
-      response = "ERROR: invalid command\n";
+      client_info.write_buffer.append("ERROR: invalid command\n");
     }
+    replied = true;
+  }
+  client_info.read_buffer.erase(0, consumed);
 
-    struct kevent event;
-    users_[client_socket].write_buffer.append(std::move(response));
-    EV_SET(&event, client_socket, EVFILT_WRITE, EV_ENABLE, 0, 0, NULL);
-    if (kevent(kq_, &event, 1, NULL, 0, NULL) < 0) {
-      std::cerr << "kevent write failed" << std::endl;
+  // answer the whole pipeline with one write instead of waiting for the
+  // next EVFILT_WRITE round trip.
+  if (replied) {
+    flush_client(client_socket, client_info);
+  }
+}
+
+/* runs one command line. pubsub messages and invalidations the command
+ * raises for its own connection are held back until the reply is complete,
+ * so they never end up between the lines of a reply or an EXEC block. */
+void DatabaseServer::run_command(uc &client_info, Command &&cmd) {
+  executing_fd_ = client_info.uc_fd;
+  dispatch(client_info, std::move(cmd));
+  executing_fd_ = -1;
+
+  for (const auto &message : client_info.deferred) {
+    client_info.write_buffer.append_shared(message);
+  }
+  client_info.deferred.clear();
+}
+
+/* commands that need the connection are handled here, everything else goes
+ * to the command handler or, inside MULTI, into the connection's queue. */
+void DatabaseServer::dispatch(uc &client_info, Command &&cmd) {
+  if (cmd.name == "MULTI" || cmd.name == "EXEC" || cmd.name == "DISCARD" ||
+      cmd.name == "WATCH" || cmd.name == "UNWATCH") {
+    auto start = std::chrono::steady_clock::now();
+    transaction_command(client_info, cmd);
+    record_command(cmd, start);
+  } else if (client_info.in_multi) {
+    client_info.queued.push_back(std::move(cmd));
+    client_info.write_buffer.append("QUEUED\n");
+  } else {
+    execute(client_info, cmd);
+  }
+}
+
+/* MULTI, EXEC, DISCARD, WATCH and UNWATCH */
+void DatabaseServer::transaction_command(uc &client_info, const Command &cmd) {
+  OutputBuffer &reply = client_info.write_buffer;
+
+  if (cmd.name == "MULTI") {
+    if (client_info.in_multi) {
+      reply.append("ERROR: MULTI calls can not be nested\n");
       return;
     }
+    client_info.in_multi = true;
+    reply.append("OK\n");
+  } else if (cmd.name == "EXEC") {
+    if (!client_info.in_multi) {
+      reply.append("ERROR: EXEC without MULTI\n");
+      return;
+    }
+
+    bool dirty = false;
+    for (const auto &watched : client_info.watched) {
+      dirty |= storage_->version(watched.first) != watched.second;
+    }
+    unwatch_all(client_info);
+    auto queued = std::move(client_info.queued);
+    client_info.queued.clear();
+    client_info.in_multi = false;
+
+    // aborted by a watched key, nothing ran.
+    if (dirty) {
+      reply.append("-1\n");
+      return;
+    }
+    // the number of replies that follow, then one per queued command.
+    reply.append(std::to_string(queued.size()) + "\n");
+    for (const auto &queued_cmd : queued) {
+      execute(client_info, queued_cmd);
+    }
+  } else if (cmd.name == "DISCARD") {
+    if (!client_info.in_multi) {
+      reply.append("ERROR: DISCARD without MULTI\n");
+      return;
+    }
+    unwatch_all(client_info);
+    client_info.queued.clear();
+    client_info.in_multi = false;
+    reply.append("OK\n");
+  } else if (cmd.name == "WATCH") {
+    if (client_info.in_multi) {
+      reply.append("ERROR: WATCH inside MULTI is not allowed\n");
+      return;
+    }
+    if (cmd.args.empty()) {
+      reply.append("ERROR: wrong number of arguments for WATCH command\n");
+      return;
+    }
+    for (const auto &key : cmd.args) {
+      uint64_t version = storage_->watch(key);
+      client_info.watched.emplace_back(key, version);
+    }
+    reply.append("OK\n");
+  } else if (cmd.name == "UNWATCH") {
+    unwatch_all(client_info);
+    reply.append("OK\n");
+  }
+}
+
+/* runs a single command, either right away or as part of EXEC. */
+void DatabaseServer::execute(uc &client_info, const Command &cmd) {
+  // the command handler times its own commands, the ones served here are
+  // recorded the same way.
+  auto start = std::chrono::steady_clock::now();
+  if (cmd.name == "SUBSCRIBE" || cmd.name == "PSUBSCRIBE" ||
+      cmd.name == "UNSUBSCRIBE" || cmd.name == "PUNSUBSCRIBE" ||
+      cmd.name == "PUBLISH") {
+    pubsub_command(client_info, cmd);
+  } else if (cmd.name == "CLIENT") {
+    client_command(client_info, cmd);
+  } else {
+    commandHandler_->handle(cmd, client_info.write_buffer);
+    // reads are remembered for client side caching
+    if ((cmd.name == "GET" || cmd.name == "HGET" || cmd.name == "LGET") &&
+        !cmd.args.empty()) {
+      tracking_.remember(client_info.uc_fd, cmd.args[0], deliver_);
+    }
+    return;
+  }
+  record_command(cmd, start);
+}
+
+void DatabaseServer::record_command(
+    const Command &cmd, std::chrono::steady_clock::time_point start) {
+  stats_->record_command(
+      cmd, true,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+/* SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE, PUNSUBSCRIBE and PUBLISH */
+void DatabaseServer::pubsub_command(uc &client_info, const Command &cmd) {
+  OutputBuffer &reply = client_info.write_buffer;
+  int fd = client_info.uc_fd;
+
+  if (cmd.name == "SUBSCRIBE" || cmd.name == "PSUBSCRIBE") {
+    if (cmd.args.empty()) {
+      reply.append("ERROR: wrong number of arguments for " + cmd.name +
+                   " command\n");
+      return;
+    }
+    bool pattern = cmd.name == "PSUBSCRIBE";
+    for (const auto &target : cmd.args) {
+      size_t count = pattern ? pubsub_.psubscribe(fd, target)
+                             : pubsub_.subscribe(fd, target);
+      reply.append((pattern ? "psubscribe " : "subscribe ") + target + " " +
+                   std::to_string(count) + "\n");
+    }
+  } else if (cmd.name == "UNSUBSCRIBE" || cmd.name == "PUNSUBSCRIBE") {
+    bool pattern = cmd.name == "PUNSUBSCRIBE";
+    // without arguments every subscription of the kind is dropped.
+    std::vector<std::string> targets = cmd.args;
+    if (targets.empty()) {
+      targets = pattern ? pubsub_.patterns(fd) : pubsub_.channels(fd);
+    }
+    const char *kind = pattern ? "punsubscribe " : "unsubscribe ";
+    if (targets.empty()) {
+      reply.append(std::string(kind) + "-1 " +
+                   std::to_string(pubsub_.subscriptions(fd)) + "\n");
+    }
+    for (const auto &target : targets) {
+      size_t count = pattern ? pubsub_.punsubscribe(fd, target)
+                             : pubsub_.unsubscribe(fd, target);
+      reply.append(kind + target + " " + std::to_string(count) + "\n");
+    }
+  } else if (cmd.name == "PUBLISH") {
+    if (cmd.args.size() != 2) {
+      reply.append("ERROR: wrong number of arguments for PUBLISH command\n");
+      return;
+    }
+    size_t receivers = pubsub_.publish(cmd.args[0], cmd.args[1], deliver_);
+    reply.append(std::to_string(receivers) + "\n");
+  }
+}
+
+/* CLIENT TRACKING ON [BCAST] [PREFIX prefix ...] | CLIENT TRACKING OFF */
+void DatabaseServer::client_command(uc &client_info, const Command &cmd) {
+  OutputBuffer &reply = client_info.write_buffer;
+  std::vector<std::string> args = cmd.args;
+  for (size_t i = 0; i < args.size() && i < 2; ++i) {
+    for (char &c : args[i]) {
+      c = toupper(c);
+    }
+  }
+
+  if (args.size() < 2 || args[0] != "TRACKING") {
+    reply.append("ERROR: usage CLIENT TRACKING ON|OFF [BCAST] "
+                 "[PREFIX prefix ...]\n");
+    return;
+  }
+  if (args[1] == "OFF" && args.size() == 2) {
+    tracking_.disable(client_info.uc_fd);
+    reply.append("OK\n");
+    return;
+  }
+  if (args[1] != "ON") {
+    reply.append("ERROR: usage CLIENT TRACKING ON|OFF [BCAST] "
+                 "[PREFIX prefix ...]\n");
+    return;
+  }
+
+  bool bcast = false;
+  std::vector<std::string> prefixes;
+  for (size_t i = 2; i < args.size(); ++i) {
+    std::string option = args[i];
+    for (char &c : option) {
+      c = toupper(c);
+    }
+    if (option == "BCAST") {
+      bcast = true;
+    } else if (option == "PREFIX" && i + 1 < args.size()) {
+      prefixes.push_back(args[++i]);
+    } else {
+      reply.append("ERROR: unknown CLIENT TRACKING option " + args[i] + "\n");
+      return;
+    }
+  }
+  if (!prefixes.empty() && !bcast) {
+    reply.append("ERROR: PREFIX requires BCAST\n");
+    return;
+  }
+
+  tracking_.enable(client_info.uc_fd, bcast, prefixes);
+  reply.append("OK\n");
+}
+
+/* queue a shared pubsub or invalidation message for a client. the write itself happens
+ * on its next EVFILT_WRITE, so a publish only costs one append per
+ * subscriber. */
+void DatabaseServer::deliver(int fd, const Blob &message) {
+  uc *client_info = client(fd);
+  if (!client_info || client_info->closing) {
+    return;
+  }
+  // the client is in the middle of its own reply, run_command sends it.
+  if (fd == executing_fd_) {
+    client_info->deferred.push_back(message);
+    return;
+  }
+  client_info->write_buffer.append_shared(message);
+  if (!enforce_output_limit(fd, *client_info)) {
+    return;
+  }
+  set_write_interest(fd, *client_info, true);
+}
+
+void DatabaseServer::unwatch_all(uc &client_info) {
+  for (const auto &watched : client_info.watched) {
+    storage_->unwatch(watched.first);
   }
+  client_info.watched.clear();
 }
@@ -1,6 +1,8 @@
 #include <cstddef>
 #include <cstdint>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -11,12 +13,18 @@
 #include <utility>
 #include <variant>
 
+#include "logger.hpp"
 #include "snapshotter.hpp"
 #include "storage.hpp"
 
 Snapshotter::Snapshotter(std::shared_ptr<Storage> storage)
     : storage_(storage) {}
 
+Snapshotter::~Snapshotter() {
+  bool ok;
+  reap(ok, true);
+}
+
 bool write_uint8(std::ofstream &outfile, const uint8_t &c) {
   outfile.write(reinterpret_cast<const char *>(&c), sizeof(uint8_t));
   return outfile.good();
@@ -35,6 +43,15 @@ bool read_uint32(std::ifstream &infile, uint32_t &number) {
   return !!infile.read(reinterpret_cast<char *>(&number), sizeof(uint32_t));
 }
 
+bool write_uint64(std::ofstream &outfile, const uint64_t &number) {
+  outfile.write(reinterpret_cast<const char *>(&number), sizeof(uint64_t));
+  return outfile.good();
+}
+
+bool read_uint64(std::ifstream &infile, uint64_t &number) {
+  return !!infile.read(reinterpret_cast<char *>(&number), sizeof(uint64_t));
+}
+
 bool write_string(std::ofstream &outfile, const std::string &str) {
   if (!write_uint32(outfile, str.length())) {
     return false;
@@ -53,13 +70,15 @@ bool read_string(std::ifstream &infile, std::string &str) {
 }
 
 bool Snapshotter::save(const std::string &filename, SnapshotFormat &format) {
-  if (format != SnapshotFormat::CUSTOM) {
+  if (format != SnapshotFormat::CUSTOM || saving()) {
     return false;
   }
 
   auto pid = fork();
+  // the child writes synchronously, the logger's writer thread only lives
+  // in the parent.
   if (pid < 0) {
-    std::cerr << "ERROR: forking did not work" << std::endl;
+    LOG_ERROR("forking did not work: %s", strerror(errno));
     return false;
   } else if (pid == 0) {
     std::cout << "Saving kvstore state..." << std::endl;
@@ -75,22 +94,23 @@ bool Snapshotter::save(const std::string &filename, SnapshotFormat &format) {
         _exit(EXIT_FAILURE);
       }
 
-      if (const auto &hashmap =
-              std::get_if<std::unordered_map<std::string, std::string>>(
-                  &value)) {
+      if (const auto &hashmap = std::get_if<CPPRedisHash>(&value)) {
         write_uint8(outfile, HMAP);
         write_string(outfile, key);
         write_uint32(outfile, hashmap->size());
         for (const auto &kv : *hashmap) {
           write_string(outfile, kv.first);
-          write_string(outfile, kv.second);
+          write_string(outfile, *kv.second);
         }
-      } else if (const auto &str = std::get_if<std::string>(&value)) {
+      } else if (const auto &str = std::get_if<Blob>(&value)) {
         write_uint8(outfile, MAP);
         write_string(outfile, key);
-        write_string(outfile, *str);
-      } else if (const auto vec =
-                     std::get_if<std::vector<std::string>>(&value)) {
+        write_string(outfile, **str);
+      } else if (const auto number = std::get_if<int64_t>(&value)) {
+        write_uint8(outfile, INT);
+        write_string(outfile, key);
+        write_uint64(outfile, static_cast<uint64_t>(*number));
+      } else if (const auto vec = std::get_if<CPPRedisList>(&value)) {
         write_uint8(outfile, LIST);
         write_string(outfile, key);
         write_uint32(outfile, vec->size());
@@ -105,9 +125,33 @@ bool Snapshotter::save(const std::string &filename, SnapshotFormat &format) {
     write_uint32(outfile, storage_->size());
     storage_->visitAll(writer);
     outfile.close();
-    _exit(EXIT_SUCCESS);
+    _exit(outfile ? EXIT_SUCCESS : EXIT_FAILURE);
   }
 
+  child_ = pid;
+  return true;
+}
+
+bool Snapshotter::reap(bool &ok, bool block) {
+  if (!saving()) {
+    return false;
+  }
+
+  int status;
+  pid_t pid;
+  do {
+    pid = waitpid(child_, &status, block ? 0 : WNOHANG);
+  } while (pid < 0 && errno == EINTR);
+  if (pid == 0) {
+    return false;
+  }
+  if (pid < 0) {
+    LOG_ERROR("waiting for the save child failed: %s", strerror(errno));
+    ok = false;
+  } else {
+    ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  }
+  child_ = -1;
   return true;
 }
 
@@ -118,76 +162,77 @@ bool Snapshotter::load(const std::string &filename, SnapshotFormat &format) {
 
   std::ifstream infile(filename, std::ifstream::binary);
   if (!infile.is_open()) {
-    std::cerr << "Failed to open file for writing: " << filename << std::endl;
+    LOG_ERROR("Failed to open file for reading: %s", filename.c_str());
     return false;
   }
 
   std::unordered_map<std::string, CPPRedisValue> new_kvstore;
   uint32_t kvstore_size, curr_size;
   if (!read_uint32(infile, kvstore_size)) {
-    std::cerr << "ERROR CHILD_PROCESS: could not read kvstore_size"
-              << std::endl;
+    LOG_ERROR("snapshot load: could not read kvstore_size");
     return false;
   }
   new_kvstore.reserve(kvstore_size);
   uint8_t type;
   for (int i = 0; i < kvstore_size; ++i) {
     if (!read_uint8(infile, type)) {
-      std::cerr << "ERROR CHILD_PROCESS: could not read type" << std::endl;
+      LOG_ERROR("snapshot load: could not read type");
       return false;
     }
 
     std::string key;
     if (!read_string(infile, key)) {
-      std::cerr << "ERROR CHILD_PROCESS: could not read key" << std::endl;
+      LOG_ERROR("snapshot load: could not read key");
       return false;
     }
 
     if (type == MAP) {
       std::string value;
       if (!read_string(infile, value)) {
-        std::cerr << "ERROR CHILD_PROCESS: could not read MAP value"
-                  << std::endl;
+        LOG_ERROR("snapshot load: could not read MAP value");
+        return false;
+      }
+      new_kvstore.emplace(std::move(key), make_blob(std::move(value)));
+    } else if (type == INT) {
+      uint64_t number;
+      if (!read_uint64(infile, number)) {
+        LOG_ERROR("snapshot load: could not read INT value");
         return false;
       }
-      new_kvstore.emplace(std::move(key), std::move(value));
+      new_kvstore.emplace(std::move(key), static_cast<int64_t>(number));
     } else if (type == HMAP) {
       if (!read_uint32(infile, curr_size)) {
-        std::cerr << "ERROR CHILD_PROCESS: could not read HMAP size"
-                  << std::endl;
+        LOG_ERROR("snapshot load: could not read HMAP size");
       }
-      std::unordered_map<std::string, std::string> hashmap;
+      CPPRedisHash hashmap;
       hashmap.reserve(curr_size);
       for (int i = 0; i < curr_size; ++i) {
         std::string key, value;
         if (!read_string(infile, key) || !read_string(infile, value)) {
-          std::cerr << "ERROR CHILD_PROCESS: could not read kv from hashmap"
-                    << std::endl;
+          LOG_ERROR("snapshot load: could not read kv from hashmap");
         }
-        hashmap.emplace(std::move(key), std::move(value));
+        hashmap.emplace(std::move(key), make_blob(std::move(value)));
       }
       new_kvstore.emplace(std::move(key), std::move(hashmap));
     } else if (type == LIST) {
       if (!read_uint32(infile, curr_size)) {
-        std::cerr << "ERROR CHILD_PROCESS: could not read LIST size"
-                  << std::endl;
+        LOG_ERROR("snapshot load: could not read LIST size");
       }
-      std::vector<std::string> list;
+      CPPRedisList list;
       list.reserve(curr_size);
       for (int i = 0; i < curr_size; ++i) {
         std::string item;
         if (!read_string(infile, item)) {
-          std::cerr << "ERROR CHILD_PROCESS: could not read item from list"
-                    << std::endl;
+          LOG_ERROR("snapshot load: could not read item from list");
         }
         list.push_back(std::move(item));
       }
       new_kvstore.emplace(std::move(key), std::move(list));
     } else {
-      std::cerr << "error: unexpected token" << std::endl;
+      LOG_ERROR("snapshot load: unexpected token");
       break;
     }
   }
 
-  return storage_->setKVStore(new_kvstore);
+  return storage_->setKVStore(std::move(new_kvstore));
 }
@@ -0,0 +1,42 @@
+#include "stats.hpp"
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+void Stats::record_command(const Command &cmd, bool known,
+                           uint64_t duration_ns) {
+  ++total_commands;
+  // unknown names are folded together so clients can't grow the table.
+  auto &command = commands[known ? cmd.name : "UNKNOWN"];
+  ++command.calls;
+  command.latency.record(duration_ns);
+
+  uint64_t duration_us = duration_ns / 1000;
+  if (duration_us < slowlog_threshold_us) {
+    return;
+  }
+
+  std::string line = cmd.name;
+  for (const auto &arg : cmd.args) {
+    if (line.size() >= SLOWLOG_MAX_COMMAND) {
+      break;
+    }
+    line += ' ';
+    line += arg;
+  }
+  if (line.size() > SLOWLOG_MAX_COMMAND) {
+    line.resize(SLOWLOG_MAX_COMMAND);
+  }
+
+  slowlog.push_front(
+      {slowlog_next_id++, std::time(nullptr), duration_us, std::move(line)});
+  if (slowlog.size() > SLOWLOG_MAX_LEN) {
+    slowlog.pop_back();
+  }
+}
+
+void Stats::record_loop_iteration(uint64_t duration_us) {
+  ++loop_iterations;
+  loop_lag_us.record(duration_us);
+}
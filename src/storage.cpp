@@ -1,15 +1,115 @@
 #include "storage.hpp"
+#include "lazy_free.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
-#include <optional>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
 
+Blob make_blob(std::string value) {
+  return std::make_shared<const std::string>(std::move(value));
+}
+
+// only canonical integers qualify ("7", "-3", not "07", "+7" or "-0"), so
+// reading the value back gives exactly what was written.
+bool parse_int64(std::string_view str, int64_t &number) {
+  if (str.empty() || str.size() > 20) {
+    return false;
+  }
+  size_t digits = str[0] == '-' ? 1 : 0;
+  if (digits == str.size() ||
+      (str[digits] == '0' && (str.size() > 1 || digits == 1))) {
+    return false;
+  }
+  auto result = std::from_chars(str.data(), str.data() + str.size(), number);
+  return result.ec == std::errc() && result.ptr == str.data() + str.size();
+}
+
+bool parse_double(std::string_view str, double &number) {
+  // strtod alone would also take "0x1p4", "inf" or leading spaces.
+  size_t i = 0;
+  auto digits = [&] {
+    size_t start = i;
+    while (i < str.size() && str[i] >= '0' && str[i] <= '9') {
+      ++i;
+    }
+    return i - start;
+  };
+  if (i < str.size() && (str[i] == '+' || str[i] == '-')) {
+    ++i;
+  }
+  size_t mantissa = digits();
+  if (i < str.size() && str[i] == '.') {
+    ++i;
+    mantissa += digits();
+  }
+  if (mantissa == 0) {
+    return false;
+  }
+  if (i < str.size() && (str[i] == 'e' || str[i] == 'E')) {
+    ++i;
+    if (i < str.size() && (str[i] == '+' || str[i] == '-')) {
+      ++i;
+    }
+    if (digits() == 0) {
+      return false;
+    }
+  }
+  if (i != str.size()) {
+    return false;
+  }
+
+  number = std::strtod(std::string(str).c_str(), nullptr);
+  return std::isfinite(number);
+}
+
+std::string format_int64(int64_t number) {
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+  return std::string(buffer, result.ptr);
+}
+
+static CPPRedisValue encode_string(const std::string &value) {
+  int64_t number;
+  if (parse_int64(value, number)) {
+    return number;
+  }
+  return make_blob(value);
+}
+
+// number of allocations destroying the value takes, roughly.
+static size_t free_effort(const CPPRedisValue &value) {
+  if (auto *map = std::get_if<CPPRedisHash>(&value)) {
+    return map->size();
+  }
+  if (auto *list = std::get_if<CPPRedisList>(&value)) {
+    return list->size();
+  }
+  if (auto *str = std::get_if<Blob>(&value)) {
+    // a Blob still referenced by an output buffer isn't freed here anyway.
+    if (*str && str->use_count() == 1 &&
+        (*str)->size() >= LAZYFREE_BLOB_BYTES) {
+      return LAZYFREE_THRESHOLD + 1;
+    }
+  }
+  return 1;
+}
+
+Storage::Storage(std::shared_ptr<LazyFree> lazy_free)
+    : lazy_free_(std::move(lazy_free)) {}
+
 template <typename T> T *Storage::get_if_type(const std::string &key) {
   auto it = kvstore_.find(key);
   if (it != kvstore_.end()) {
@@ -22,64 +122,210 @@ uint32_t Storage::size() { return kvstore_.size(); }
 
 void Storage::hset(const std::string &key, const std::string &field,
                    const std::string &value) {
-  if (auto *map =
-          get_if_type<std::unordered_map<std::string, std::string>>(key)) {
-    (*map)[field] = value;
-    return;
+  if (auto *map = get_if_type<CPPRedisHash>(key)) {
+    (*map)[field] = make_blob(value);
+  } else {
+    auto slot = kvstore_.try_emplace(key);
+    if (!slot.second) {
+      count(slot.first->second, -1);
+      dispose(slot.first->second);
+    }
+    slot.first->second = CPPRedisHash{{field, make_blob(value)}};
+    ++counts_.hashes;
   }
-  kvstore_[key] = std::unordered_map<std::string, std::string>{{field, value}};
+  touch(key);
 }
 
 void Storage::ladd(const std::string &key, const std::string &value) {
-  if (auto *list = get_if_type<std::vector<std::string>>(key)) {
-    list->push_back(std::move(value));
-    return;
+  if (auto *list = get_if_type<CPPRedisList>(key)) {
+    list->push_back(value);
+  } else {
+    auto slot = kvstore_.try_emplace(key);
+    if (!slot.second) {
+      count(slot.first->second, -1);
+      dispose(slot.first->second);
+    }
+    slot.first->second = CPPRedisList{value};
+    ++counts_.lists;
   }
-  kvstore_[key] = std::vector<std::string>{value};
+  touch(key);
 }
 
 void Storage::set(const std::string &key, const std::string &value) {
-  if (get_if_type<std::string>(key) || kvstore_.find(key) == kvstore_.end()) {
-    kvstore_[key] = value;
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    kvstore_.emplace(key, encode_string(value));
+    ++counts_.strings;
+  } else if (std::holds_alternative<Blob>(it->second) ||
+             std::holds_alternative<int64_t>(it->second)) {
+    dispose(it->second);
+    it->second = encode_string(value);
+  } else {
+    // a hash or list is left alone, nothing changed.
+    return;
   }
+  touch(key);
 }
 
-std::optional<std::string> Storage::hget(const std::string &key,
-                                         const std::string &field) {
-  if (auto *map =
-          get_if_type<std::unordered_map<std::string, std::string>>(key)) {
-    return (*map)[field];
+Blob Storage::hget(const std::string &key, const std::string &field) {
+  if (auto *map = get_if_type<CPPRedisHash>(key)) {
+    auto field_it = map->find(field);
+    if (field_it != map->end()) {
+      return field_it->second;
+    }
   };
 
-  return std::nullopt;
+  return nullptr;
 }
 
-std::optional<std::string> Storage::lget(const std::string &key,
-                                         const int &idx) {
-  if (auto *list = get_if_type<std::vector<std::string>>(key)) {
-    if (idx >= list->size()) {
-      return std::nullopt;
+const std::string *Storage::lget(const std::string &key, const int &idx) {
+  if (auto *list = get_if_type<CPPRedisList>(key)) {
+    if (idx < 0 || idx >= list->size()) {
+      return nullptr;
     }
-    return (*list)[idx];
+    return &(*list)[idx];
   };
 
-  return std::nullopt;
+  return nullptr;
 }
 
-std::optional<std::string> Storage::get(const std::string &key) {
-  if (auto *ptr = get_if_type<std::string>(key)) {
+Blob Storage::get(const std::string &key) {
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    return nullptr;
+  }
+  if (auto *ptr = std::get_if<Blob>(&it->second)) {
     return *ptr;
-  };
+  }
+  if (auto *number = std::get_if<int64_t>(&it->second)) {
+    return make_blob(format_int64(*number));
+  }
+  return nullptr;
+}
+
+NumberStatus Storage::incrby(const std::string &key, int64_t delta,
+                             int64_t &result) {
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    kvstore_.emplace(key, delta);
+    ++counts_.strings;
+    touch(key);
+    result = delta;
+    return NumberStatus::OK;
+  }
+
+  int64_t current;
+  if (auto *number = std::get_if<int64_t>(&it->second)) {
+    current = *number;
+  } else if (auto *str = std::get_if<Blob>(&it->second)) {
+    if (!parse_int64(**str, current)) {
+      return NumberStatus::NOT_A_NUMBER;
+    }
+  } else {
+    return NumberStatus::WRONG_TYPE;
+  }
 
-  return std::nullopt;
+  if (__builtin_add_overflow(current, delta, &result)) {
+    return NumberStatus::NOT_A_NUMBER;
+  }
+  it->second = result;
+  touch(key);
+  return NumberStatus::OK;
+}
+
+NumberStatus Storage::incrbyfloat(const std::string &key, double delta,
+                                  std::string &result) {
+  auto it = kvstore_.find(key);
+  double current = 0;
+  if (it != kvstore_.end()) {
+    if (auto *number = std::get_if<int64_t>(&it->second)) {
+      current = *number;
+    } else if (auto *str = std::get_if<Blob>(&it->second)) {
+      if (!parse_double(**str, current)) {
+        return NumberStatus::NOT_A_NUMBER;
+      }
+    } else {
+      return NumberStatus::WRONG_TYPE;
+    }
+  }
+
+  double sum = current + delta;
+  if (!std::isfinite(sum)) {
+    return NumberStatus::NOT_A_NUMBER;
+  }
+  // floats stay text, like any other non-integer string. plain decimal
+  // notation without an exponent, with the fewest significant digits that
+  // still read back as the same double and no trailing zeros.
+  if (sum == 0) {
+    sum = 0; // no "-0"
+  }
+  int exponent =
+      sum == 0 ? 0 : static_cast<int>(std::floor(std::log10(std::fabs(sum))));
+  // up to 309 integer digits or 340 decimals for the smallest subnormal
+  char buffer[400];
+  for (int digits = 15; digits <= 17; ++digits) {
+    snprintf(buffer, sizeof(buffer), "%.*f", std::max(0, digits - 1 - exponent),
+             sum);
+    if (std::strtod(buffer, nullptr) == sum) {
+      break;
+    }
+  }
+  if (std::strchr(buffer, '.')) {
+    char *end = buffer + std::strlen(buffer);
+    while (end[-1] == '0') {
+      --end;
+    }
+    if (end[-1] == '.') {
+      --end;
+    }
+    *end = '\0';
+  }
+  if (kvstore_.insert_or_assign(key, encode_string(buffer)).second) {
+    ++counts_.strings;
+  }
+  touch(key);
+  result = buffer;
+  return NumberStatus::OK;
+}
+
+NumberStatus Storage::hincrby(const std::string &key, const std::string &field,
+                              int64_t delta, int64_t &result) {
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    kvstore_.emplace(key,
+                     CPPRedisHash{{field, make_blob(format_int64(delta))}});
+    ++counts_.hashes;
+    touch(key);
+    result = delta;
+    return NumberStatus::OK;
+  }
+  auto *map = std::get_if<CPPRedisHash>(&it->second);
+  if (!map) {
+    return NumberStatus::WRONG_TYPE;
+  }
+
+  // hash fields are plain Blobs, the number is re-encoded on every update.
+  int64_t current = 0;
+  auto field_it = map->find(field);
+  if (field_it != map->end() && !parse_int64(*field_it->second, current)) {
+    return NumberStatus::NOT_A_NUMBER;
+  }
+
+  if (__builtin_add_overflow(current, delta, &result)) {
+    return NumberStatus::NOT_A_NUMBER;
+  }
+  (*map)[field] = make_blob(format_int64(result));
+  touch(key);
+  return NumberStatus::OK;
 }
 
 bool Storage::ldel(const std::string &key, const int &idx) {
-  if (auto *list = get_if_type<std::vector<std::string>>(key)) {
+  if (auto *list = get_if_type<CPPRedisList>(key)) {
     if (idx >= list->size()) {
       return false;
     }
     list->erase(list->begin() + idx);
+    touch(key);
     return true;
   };
 
@@ -87,18 +333,41 @@ bool Storage::ldel(const std::string &key, const int &idx) {
 }
 
 bool Storage::hdel(const std::string &key, const std::string &field) {
-  if (auto map =
-          get_if_type<std::unordered_map<std::string, std::string>>(key)) {
+  if (auto map = get_if_type<CPPRedisHash>(key)) {
     auto field_it = map->find(field);
     if (field_it != map->end()) {
-      return map->erase(field);
+      map->erase(field_it);
+      touch(key);
+      return true;
     }
   };
 
   return false;
 }
 
-bool Storage::del(const std::string &key) { return kvstore_.erase(key); }
+bool Storage::del(const std::string &key) {
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    return false;
+  }
+  count(it->second, -1);
+  kvstore_.erase(it);
+  touch(key);
+  return true;
+}
+
+bool Storage::unlink(const std::string &key) {
+  auto it = kvstore_.find(key);
+  if (it == kvstore_.end()) {
+    return false;
+  }
+  count(it->second, -1);
+  dispose(it->second);
+  kvstore_.erase(it);
+  touch(key);
+  return true;
+}
+
 // CAUTION: not thread safe.
 void Storage::visitAll(const KVPairVisitor &visitor) {
   for (const auto &pair : kvstore_) {
@@ -107,7 +376,75 @@ void Storage::visitAll(const KVPairVisitor &visitor) {
 }
 
 bool Storage::setKVStore(
-    const std::unordered_map<std::string, CPPRedisValue> &kv_store) {
-  kvstore_ = kv_store;
+    std::unordered_map<std::string, CPPRedisValue> kv_store) {
+  if (key_listener_) {
+    key_listener_("");
+  }
+  kvstore_.swap(kv_store);
+  counts_ = KeyspaceCounts();
+  for (const auto &pair : kvstore_) {
+    count(pair.second, 1);
+  }
+  // kv_store now holds the old keyspace. handing it over is a move, a few
+  // keys can still hold millions of elements, so it always goes.
+  if (lazy_free_ && !kv_store.empty()) {
+    lazy_free_->release(std::move(kv_store));
+  }
+  for (auto &entry : watched_) {
+    ++entry.second.version;
+  }
   return true;
 }
+
+void Storage::touch(const std::string &key) {
+  if (key_listener_) {
+    key_listener_(key);
+  }
+  if (watched_.empty()) {
+    return;
+  }
+  auto it = watched_.find(key);
+  if (it != watched_.end()) {
+    ++it->second.version;
+  }
+}
+
+void Storage::count(const CPPRedisValue &value, int64_t delta) {
+  if (std::holds_alternative<CPPRedisHash>(value)) {
+    counts_.hashes += delta;
+  } else if (std::holds_alternative<CPPRedisList>(value)) {
+    counts_.lists += delta;
+  } else {
+    counts_.strings += delta;
+  }
+}
+
+// moves a large value to the lazy free thread, leaving an empty one behind
+// that is cheap to overwrite or erase.
+void Storage::dispose(CPPRedisValue &value) {
+  if (lazy_free_ && free_effort(value) > LAZYFREE_THRESHOLD) {
+    lazy_free_->release(std::move(value));
+  }
+}
+
+uint64_t Storage::watch(const std::string &key) {
+  auto &entry = watched_.try_emplace(key, WatchedKey{0, 0}).first->second;
+  ++entry.watchers;
+  return entry.version;
+}
+
+void Storage::unwatch(const std::string &key) {
+  auto it = watched_.find(key);
+  if (it != watched_.end() && --it->second.watchers == 0) {
+    watched_.erase(it);
+  }
+}
+
+uint64_t Storage::version(const std::string &key) {
+  auto it = watched_.find(key);
+  return it == watched_.end() ? 0 : it->second.version;
+}
+
+void Storage::setKeyListener(KeyListener listener) {
+  key_listener_ = std::move(listener);
+}
@@ -0,0 +1,25 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+TimerWheel::TimerWheel(size_t slots) : slots_(std::max<size_t>(slots, 2)) {}
+
+void TimerWheel::schedule(int fd, uint64_t id, uint64_t ticks) {
+  ticks = std::clamp<uint64_t>(ticks, 1, slots_.size() - 1);
+  slots_[(cursor_ + ticks) % slots_.size()].push_back({fd, id});
+  ++size_;
+}
+
+void TimerWheel::tick(const Expire &expire) {
+  cursor_ = (cursor_ + 1) % slots_.size();
+  // the callback may schedule again, never into the slot being expired.
+  expired_.swap(slots_[cursor_]);
+  size_ -= expired_.size();
+  for (const auto &entry : expired_) {
+    expire(entry.fd, entry.id);
+  }
+  expired_.clear();
+}
@@ -0,0 +1,120 @@
+#include "tracking.hpp"
+
+#include <list>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+void Tracking::enable(int fd, bool bcast,
+                      const std::vector<std::string> &prefixes) {
+  disable(fd);
+  Client client{bcast, prefixes};
+  if (bcast && client.prefixes.empty()) {
+    client.prefixes.emplace_back();
+  }
+  if (bcast) {
+    for (const auto &prefix : client.prefixes) {
+      prefixes_[prefix].insert(fd);
+    }
+  }
+  clients_.emplace(fd, std::move(client));
+}
+
+void Tracking::disable(int fd) {
+  auto client = clients_.find(fd);
+  if (client == clients_.end()) {
+    return;
+  }
+  if (client->second.bcast) {
+    for (const auto &prefix : client->second.prefixes) {
+      auto it = prefixes_.find(prefix);
+      if (it != prefixes_.end()) {
+        it->second.erase(fd);
+        if (it->second.empty()) {
+          prefixes_.erase(it);
+        }
+      }
+    }
+  }
+  clients_.erase(client);
+}
+
+bool Tracking::enabled(int fd) const { return clients_.count(fd); }
+
+void Tracking::remember(int fd, const std::string &key,
+                        const Invalidate &invalidate) {
+  auto client = clients_.find(fd);
+  if (client == clients_.end() || client->second.bcast) {
+    return;
+  }
+  auto inserted = keys_.try_emplace(key);
+  inserted.first->second.readers.insert(fd);
+  if (!inserted.second) {
+    return;
+  }
+  inserted.first->second.order =
+      order_.insert(order_.end(), &inserted.first->first);
+
+  // keep the table bounded, evicted keys are invalidated so no client keeps
+  // a cached value nobody would tell it about. the key just read is the
+  // newest one, the front never is unless it's the only one.
+  while (keys_.size() > max_keys_ && keys_.size() > 1) {
+    std::string victim = *order_.front();
+    invalidate_key(victim, invalidate);
+  }
+}
+
+void Tracking::invalidate_key(const std::string &key,
+                              const Invalidate &invalidate) {
+  auto it = keys_.find(key);
+  if (it == keys_.end()) {
+    return;
+  }
+  Blob message = make_blob("invalidate " + key + "\n");
+  for (int fd : it->second.readers) {
+    if (clients_.count(fd)) {
+      invalidate(fd, message);
+    }
+  }
+  // clients have to read the key again to be told about the next change.
+  order_.erase(it->second.order);
+  keys_.erase(it);
+}
+
+void Tracking::key_changed(const std::string &key,
+                           const Invalidate &invalidate) {
+  if (clients_.empty()) {
+    return;
+  }
+
+  if (key.empty()) {
+    Blob message = make_blob("invalidate\n");
+    for (const auto &client : clients_) {
+      invalidate(client.first, message);
+    }
+    keys_.clear();
+    order_.clear();
+    return;
+  }
+
+  invalidate_key(key, invalidate);
+
+  if (prefixes_.empty()) {
+    return;
+  }
+  Blob message;
+  std::unordered_set<int> notified;
+  for (const auto &prefix : prefixes_) {
+    if (key.compare(0, prefix.first.size(), prefix.first) != 0) {
+      continue;
+    }
+    if (!message) {
+      message = make_blob("invalidate " + key + "\n");
+    }
+    for (int fd : prefix.second) {
+      if (notified.insert(fd).second) {
+        invalidate(fd, message);
+      }
+    }
+  }
+}
@@ -1,9 +1,543 @@
 #include <catch2/catch_test_macros.hpp>
 
+#include "command_handler.hpp"
+#include "lazy_free.hpp"
+#include "latency_histogram.hpp"
+#include "logger.hpp"
+#include "output_buffer.hpp"
+#include "parser.hpp"
+#include "pubsub.hpp"
 #include "storage.hpp"
+#include "timer_wheel.hpp"
+#include "tracking.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 TEST_CASE("storage 2load functions correctly", "[hehe]") {
   Storage storage = Storage();
 
   storage.del("hehe");
 }
+
+TEST_CASE("storage reads do not copy or insert", "[storage]") {
+  Storage storage = Storage();
+
+  storage.hset("hash", "field", "value");
+  REQUIRE(*storage.hget("hash", "field") == "value");
+  REQUIRE(storage.hget("hash", "missing") == nullptr);
+  REQUIRE(storage.hdel("hash", "missing") == false);
+
+  storage.set("key", "value");
+  REQUIRE(storage.get("key") == storage.get("key"));
+  REQUIRE(storage.get("missing") == nullptr);
+}
+
+TEST_CASE("command handler appends replies in place", "[handler]") {
+  CommandHandler handler(std::make_shared<Storage>());
+  Parser parser;
+
+  OutputBuffer reply;
+  handler.handle(*parser.parse("set key value"), reply);
+  handler.handle(*parser.parse("  GET   key "), reply);
+  handler.handle(*parser.parse("hget key field"), reply);
+  REQUIRE(reply.str() == "OK\nvalue\n-1\n");
+  REQUIRE_FALSE(parser.parse("   "));
+}
+
+TEST_CASE("output buffer references large values", "[output]") {
+  Blob large = make_blob(std::string(ZERO_COPY_THRESHOLD, 'x'));
+  OutputBuffer out;
+  out.append("head ");
+  out.append(large);
+  out.append(make_blob("\n"));
+  REQUIRE(large.use_count() == 2);
+  REQUIRE(out.size() == ZERO_COPY_THRESHOLD + 6);
+
+  struct iovec iov[IOV_AMOUNT];
+  REQUIRE(out.fill_iov(iov, IOV_AMOUNT) == 3);
+  REQUIRE(iov[1].iov_base == large->data());
+
+  out.consume(7);
+  REQUIRE(out.fill_iov(iov, IOV_AMOUNT) == 2);
+  REQUIRE(iov[0].iov_len == ZERO_COPY_THRESHOLD - 2);
+  out.consume(ZERO_COPY_THRESHOLD - 2);
+  REQUIRE(large.use_count() == 1);
+  REQUIRE(out.str() == "\n");
+}
+
+TEST_CASE("output buffer releases sent bytes of a pipeline", "[output]") {
+  OutputBuffer out;
+  std::string reply(100, 'x');
+  // the socket never drains the buffer completely
+  for (int i = 0; i < 100000; ++i) {
+    out.append(reply);
+    if (out.size() > 500) {
+      out.consume(out.size() - 500);
+    }
+  }
+  REQUIRE(out.size() == 500);
+  REQUIRE(out.retained() <= 2 * OUTPUT_CHUNK_SIZE);
+}
+
+TEST_CASE("latency histogram percentiles", "[histogram]") {
+  LatencyHistogram histogram;
+  for (uint64_t i = 1; i <= 100000; ++i) {
+    histogram.record(i);
+  }
+  REQUIRE(histogram.count() == 100000);
+  REQUIRE(histogram.min() == 1);
+  REQUIRE(histogram.max() == 100000);
+
+  auto p50 = histogram.percentile(50);
+  auto p99 = histogram.percentile(99);
+  REQUIRE(p50 > 48500);
+  REQUIRE(p50 < 51500);
+  REQUIRE(p99 > 96000);
+  REQUIRE(p99 <= 100000);
+  REQUIRE(histogram.percentile(100) == 100000);
+}
+
+TEST_CASE("command handler records stats and slowlog", "[stats]") {
+  auto stats = std::make_shared<Stats>();
+  stats->slowlog_threshold_us = 0;
+  CommandHandler handler(std::make_shared<Storage>(), stats);
+
+  handler.handle(Command{"SET", {"key", "value"}});
+  handler.handle(Command{"GET", {"key"}});
+  handler.handle(Command{"NOPE", {}});
+
+  REQUIRE(stats->total_commands == 3);
+  REQUIRE(stats->commands["SET"].calls == 1);
+  REQUIRE(stats->commands["UNKNOWN"].calls == 1);
+  REQUIRE(stats->commands.count("NOPE") == 0);
+  REQUIRE(stats->slowlog.size() == 3);
+  REQUIRE(stats->slowlog.front().command == "NOPE");
+  REQUIRE(handler.handle(Command{"SLOWLOG", {"len"}}) == "3\n");
+  REQUIRE(handler.handle(Command{"INFO", {"keyspace"}}) ==
+          "# Keyspace\nkeys:1\nstrings:1\nlists:0\nhashes:0\n\n");
+  REQUIRE(handler.handle(Command{"INFO", {"KeySpace"}}) ==
+          "# Keyspace\nkeys:1\nstrings:1\nlists:0\nhashes:0\n\n");
+  REQUIRE(handler.handle(Command{"INFO", {"bogus"}}) ==
+          "ERROR: unknown INFO section\n");
+}
+
+static void wait_for_save(CommandHandler &handler, Stats &stats,
+                          uint64_t saves) {
+  for (int i = 0; i < 5000 && stats.saves < saves; ++i) {
+    usleep(1000);
+    handler.reap_save();
+  }
+}
+
+TEST_CASE("save records how the child finished", "[snapshot]") {
+  auto stats = std::make_shared<Stats>();
+  CommandHandler handler(std::make_shared<Storage>(), stats);
+  handler.handle(Command{"SET", {"key", "value"}});
+  std::string filename =
+      "/tmp/cpp_redis_test_" + std::to_string(getpid()) + ".snapshot";
+
+  REQUIRE(handler.handle(Command{"SAVE", {filename, "custom"}}) == "OK\n");
+  wait_for_save(handler, *stats, 1);
+  REQUIRE(stats->saves == 1);
+  REQUIRE(stats->failed_saves == 0);
+  REQUIRE(stats->last_save_ok);
+  REQUIRE(!handler.saving());
+  REQUIRE(handler.handle(Command{"LOAD", {filename, "custom"}}) == "OK\n");
+  unlink(filename.c_str());
+
+  // the fork succeeds, the child can't open the file
+  REQUIRE(handler.handle(Command{"SAVE", {"/nonexistent/dir/file", "custom"}}) ==
+          "OK\n");
+  wait_for_save(handler, *stats, 2);
+  REQUIRE(stats->saves == 2);
+  REQUIRE(stats->failed_saves == 1);
+  REQUIRE(!stats->last_save_ok);
+  std::string info = handler.handle(Command{"INFO", {"persistence"}});
+  REQUIRE(info.find("save_in_progress:0\n") != std::string::npos);
+  REQUIRE(info.find("last_save_status:err\n") != std::string::npos);
+}
+
+TEST_CASE("integer encoded counters", "[storage]") {
+  Storage storage = Storage();
+
+  int64_t number = 0;
+  std::string text;
+
+  storage.set("counter", "41");
+  REQUIRE(storage.incrby("counter", 1, number) == NumberStatus::OK);
+  REQUIRE(number == 42);
+  REQUIRE(*storage.get("counter") == "42");
+  REQUIRE(storage.incrby("missing", -3, number) == NumberStatus::OK);
+  REQUIRE(number == -3);
+
+  storage.set("text", "007");
+  REQUIRE(storage.incrby("text", 1, number) == NumberStatus::NOT_A_NUMBER);
+  REQUIRE(*storage.get("text") == "007");
+
+  storage.set("max", "9223372036854775807");
+  REQUIRE(storage.incrby("max", 1, number) == NumberStatus::NOT_A_NUMBER);
+
+  REQUIRE(storage.incrbyfloat("float", 10.5, text) == NumberStatus::OK);
+  REQUIRE(text == "10.5");
+  storage.incrbyfloat("float", 0.1, text);
+  REQUIRE(text == "10.6");
+  storage.incrbyfloat("counter", 0.5, text);
+  REQUIRE(text == "42.5");
+  // never exponent notation
+  storage.incrbyfloat("big", 1e20, text);
+  REQUIRE(text == "100000000000000000000");
+  storage.incrbyfloat("small", 1.5e-7, text);
+  REQUIRE(text == "0.00000015");
+  storage.incrbyfloat("small", -1.5e-7, text);
+  REQUIRE(text == "0");
+  REQUIRE(*storage.get("big") == "100000000000000000000");
+
+  REQUIRE(storage.hincrby("hash", "field", 5, number) == NumberStatus::OK);
+  REQUIRE(number == 5);
+  storage.hincrby("hash", "field", -7, number);
+  REQUIRE(number == -2);
+  REQUIRE(*storage.hget("hash", "field") == "-2");
+
+  // other types are told apart from values that aren't numbers
+  storage.ladd("list", "x");
+  REQUIRE(storage.hincrby("counter", "field", 1, number) ==
+          NumberStatus::WRONG_TYPE);
+  REQUIRE(storage.incrby("list", 1, number) == NumberStatus::WRONG_TYPE);
+  REQUIRE(storage.incrbyfloat("hash", 1, text) == NumberStatus::WRONG_TYPE);
+
+  CommandHandler handler(std::make_shared<Storage>());
+  REQUIRE(handler.handle(Command{"INCR", {"c"}}) == "1\n");
+  REQUIRE(handler.handle(Command{"INCRBY", {"c", "10"}}) == "11\n");
+  REQUIRE(handler.handle(Command{"DECR", {"c"}}) == "10\n");
+  REQUIRE(handler.handle(Command{"INCRBY", {"c", "x"}}) ==
+          "ERROR: value is not an integer or out of range\n");
+  REQUIRE(handler.handle(Command{"GET", {"c"}}) == "10\n");
+  REQUIRE(handler.handle(Command{"INCRBYFLOAT", {"f", "0x10"}}) ==
+          "ERROR: value is not a valid float\n");
+  REQUIRE(handler.handle(Command{"INCRBYFLOAT", {"f", "1.5e1"}}) == "15\n");
+  handler.handle(Command{"SET", {"hex", "0x1p4"}});
+  REQUIRE(handler.handle(Command{"INCRBYFLOAT", {"hex", "1"}}) ==
+          "ERROR: value is not a valid float\n");
+  handler.handle(Command{"LADD", {"l", "x"}});
+  REQUIRE(handler.handle(Command{"INCR", {"l"}}) ==
+          "ERROR: WRONGTYPE operation against a key holding the wrong kind "
+          "of value\n");
+}
+
+TEST_CASE("watched keys change version on writes", "[storage]") {
+  Storage storage = Storage();
+
+  uint64_t version = storage.watch("key");
+  storage.set("other", "value");
+  storage.del("key");
+  REQUIRE(storage.version("key") == version);
+
+  storage.set("key", "value");
+  REQUIRE(storage.version("key") != version);
+
+  version = storage.version("key");
+  storage.del("key");
+  REQUIRE(storage.version("key") != version);
+
+  storage.unwatch("key");
+  REQUIRE(storage.version("key") == 0);
+}
+
+TEST_CASE("float parsing takes plain decimals only", "[storage]") {
+  double number;
+  REQUIRE(parse_double("-1.5", number));
+  REQUIRE(number == -1.5);
+  REQUIRE(parse_double(".5e-3", number));
+  REQUIRE(parse_double("7.", number));
+  REQUIRE_FALSE(parse_double("0x10", number));
+  REQUIRE_FALSE(parse_double("inf", number));
+  REQUIRE_FALSE(parse_double(" 1", number));
+  REQUIRE_FALSE(parse_double("1e", number));
+  REQUIRE_FALSE(parse_double(".", number));
+  REQUIRE_FALSE(parse_double("1e999", number));
+}
+
+TEST_CASE("storage counts keys per type", "[storage]") {
+  Storage storage = Storage();
+  storage.set("s", "text");
+  int64_t number;
+  std::string text;
+  storage.incrby("n", 1, number);
+  storage.incrbyfloat("f", 1.5, text);
+  storage.ladd("l", "x");
+  storage.hset("h", "f", "v");
+  storage.hincrby("h2", "f", 1, number);
+  // type changes move the key between counters
+  storage.hset("l", "f", "v");
+  storage.set("h", "ignored");
+  storage.del("s");
+  storage.unlink("n");
+
+  KeyspaceCounts counts = storage.counts();
+  REQUIRE(counts.strings == 1);
+  REQUIRE(counts.lists == 0);
+  REQUIRE(counts.hashes == 3);
+
+  std::unordered_map<std::string, CPPRedisValue> loaded;
+  loaded["list"] = CPPRedisList{"a"};
+  storage.setKVStore(std::move(loaded));
+  REQUIRE(storage.counts().lists == 1);
+  REQUIRE(storage.counts().hashes == 0);
+}
+
+TEST_CASE("failed writes leave watched keys alone", "[storage]") {
+  Storage storage = Storage();
+  storage.set("text", "abc");
+  storage.hset("hash", "field", "abc");
+
+  uint64_t text = storage.watch("text");
+  uint64_t hash = storage.watch("hash");
+  int64_t number;
+  std::string result;
+  REQUIRE(storage.incrby("text", 1, number) != NumberStatus::OK);
+  REQUIRE(storage.hincrby("hash", "field", 1, number) != NumberStatus::OK);
+  REQUIRE(storage.hincrby("text", "field", 1, number) != NumberStatus::OK);
+  REQUIRE(storage.incrbyfloat("hash", 1, result) != NumberStatus::OK);
+  // SET doesn't replace a hash
+  storage.set("hash", "value");
+  REQUIRE(storage.version("text") == text);
+  REQUIRE(storage.version("hash") == hash);
+}
+
+TEST_CASE("glob patterns", "[pubsub]") {
+  REQUIRE(glob_match("*", "anything"));
+  REQUIRE(glob_match("news.*", "news.sport"));
+  REQUIRE_FALSE(glob_match("news.*", "new"));
+  REQUIRE(glob_match("h?llo", "hallo"));
+  REQUIRE(glob_match("h[ae]llo", "hello"));
+  REQUIRE_FALSE(glob_match("h[^e]llo", "hello"));
+  REQUIRE(glob_match("h[a-c]*o", "hbxyzo"));
+  REQUIRE(glob_match("a\\*", "a*"));
+  REQUIRE_FALSE(glob_match("a\\*", "ab"));
+  REQUIRE(glob_match("*a*b", "xxaxxb"));
+}
+
+TEST_CASE("publish shares one encoded message", "[pubsub]") {
+  PubSub pubsub;
+  REQUIRE(pubsub.subscribe(4, "news") == 1);
+  REQUIRE(pubsub.subscribe(5, "news") == 1);
+  REQUIRE(pubsub.psubscribe(5, "n*") == 2);
+
+  std::vector<std::pair<int, Blob>> delivered;
+  auto deliver = [&](int fd, const Blob &message) {
+    delivered.emplace_back(fd, message);
+  };
+  REQUIRE(pubsub.publish("news", "hi", deliver) == 3);
+  REQUIRE(delivered.size() == 3);
+  REQUIRE(delivered[0].second == delivered[1].second);
+  REQUIRE(*delivered[0].second == "message news hi\n");
+  REQUIRE(*delivered[2].second == "pmessage n* news hi\n");
+
+  pubsub.remove(5);
+  delivered.clear();
+  REQUIRE(pubsub.publish("news", "hi", deliver) == 1);
+  REQUIRE(pubsub.subscriptions(5) == 0);
+}
+
+TEST_CASE("tracking invalidates read keys once", "[tracking]") {
+  Tracking tracking(2);
+  std::vector<std::pair<int, std::string>> sent;
+  auto invalidate = [&](int fd, const Blob &message) {
+    sent.emplace_back(fd, *message);
+  };
+
+  tracking.enable(4, false, {});
+  tracking.enable(5, true, {"user:"});
+  tracking.remember(4, "key", invalidate);
+  tracking.remember(5, "key", invalidate);
+
+  tracking.key_changed("key", invalidate);
+  tracking.key_changed("key", invalidate);
+  tracking.key_changed("user:1", invalidate);
+  REQUIRE(sent.size() == 2);
+  REQUIRE(sent[0].first == 4);
+  REQUIRE(sent[0].second == "invalidate key\n");
+  REQUIRE(sent[1].first == 5);
+  REQUIRE(sent[1].second == "invalidate user:1\n");
+
+  // the bounded table evicts and invalidates to make room
+  sent.clear();
+  tracking.remember(4, "a", invalidate);
+  tracking.remember(4, "b", invalidate);
+  tracking.remember(4, "c", invalidate);
+  REQUIRE(tracking.tracked_keys() == 2);
+  REQUIRE(sent.size() == 1);
+  // oldest first, reading a key again doesn't reorder it
+  REQUIRE(sent[0].second == "invalidate a\n");
+  tracking.remember(4, "b", invalidate);
+  tracking.remember(4, "d", invalidate);
+  REQUIRE(sent.size() == 2);
+  REQUIRE(sent[1].second == "invalidate b\n");
+}
+
+TEST_CASE("storage reports written keys", "[storage]") {
+  Storage storage = Storage();
+  std::vector<std::string> changed;
+  storage.setKeyListener(
+      [&](const std::string &key) { changed.push_back(key); });
+
+  storage.set("a", "1");
+  storage.hset("h", "f", "v");
+  storage.del("missing");
+  storage.del("a");
+  storage.setKVStore({});
+  std::vector<std::string> expected{"a", "h", "a", ""};
+  REQUIRE(changed == expected);
+}
+
+TEST_CASE("unlink frees large values in the background", "[lazyfree]") {
+  auto lazy_free = std::make_shared<LazyFree>();
+  Storage storage(lazy_free);
+
+  for (int i = 0; i < 1000; ++i) {
+    storage.hset("big", std::to_string(i), "v");
+  }
+  for (int i = 0; i < 100; ++i) {
+    storage.ladd("list", "x");
+  }
+  Blob field = storage.hget("big", "7");
+
+  REQUIRE(storage.unlink("big"));
+  REQUIRE_FALSE(storage.unlink("big"));
+  REQUIRE(storage.hget("big", "7") == nullptr);
+  REQUIRE(*field == "v");
+
+  // overwriting with another type detaches the old value too
+  storage.hset("list", "f", "v");
+  REQUIRE(storage.lget("list", 0) == nullptr);
+  REQUIRE(*storage.hget("list", "f") == "v");
+
+  lazy_free->drain();
+  REQUIRE(lazy_free->pending() == 0);
+  REQUIRE(storage.size() == 1);
+
+  // LOAD hands over the old keyspace no matter how few keys it has
+  uint64_t released = lazy_free->released();
+  storage.setKVStore({});
+  REQUIRE(lazy_free->released() == released + 1);
+  REQUIRE(storage.size() == 0);
+}
+
+TEST_CASE("timer wheel expires entries after their ticks", "[timer]") {
+  TimerWheel wheel(8);
+  std::vector<int> expired;
+  auto expire = [&](int fd, uint64_t id) {
+    expired.push_back(fd);
+    // rescheduling from the callback lands in a later slot
+    if (id == 2) {
+      wheel.schedule(fd, 0, 2);
+    }
+  };
+
+  wheel.schedule(5, 1, 1);
+  wheel.schedule(6, 2, 3);
+  // beyond the wheel, fires after one round
+  wheel.schedule(7, 3, 100);
+  REQUIRE(wheel.size() == 3);
+
+  std::vector<int> expected{5};
+  wheel.tick(expire);
+  REQUIRE(expired == expected);
+  expected.push_back(6);
+  wheel.tick(expire);
+  wheel.tick(expire);
+  REQUIRE(expired == expected);
+  expected.push_back(6);
+  wheel.tick(expire);
+  wheel.tick(expire);
+  REQUIRE(expired == expected);
+  expected.push_back(7);
+  wheel.tick(expire);
+  wheel.tick(expire);
+  REQUIRE(expired == expected);
+  REQUIRE(wheel.size() == 0);
+}
+
+// lines a logger writing into a pipe produced while running `body`.
+static std::vector<std::string>
+logged_lines(uint32_t burst, const std::function<void(Logger &)> &body) {
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  std::string output;
+  std::thread reader;
+  {
+    Logger logger(fds[1], burst);
+    body(logger);
+    // only read once everything is logged, a full pipe stalls the writer.
+    reader = std::thread([&] {
+      char buffer[4096];
+      ssize_t len;
+      while ((len = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, len);
+      }
+    });
+  }
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+
+  std::vector<std::string> lines;
+  std::istringstream stream(output);
+  for (std::string line; std::getline(stream, line);) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+static size_t count_containing(const std::vector<std::string> &lines,
+                               const std::string &text) {
+  return std::count_if(lines.begin(), lines.end(), [&](const std::string &l) {
+    return l.find(text) != std::string::npos;
+  });
+}
+
+TEST_CASE("logger limits every call site on its own", "[logger]") {
+  auto lines = logged_lines(LOG_RATE_BURST, [](Logger &logger) {
+    for (int i = 0; i < 50; ++i) {
+      logger.log(LogLevel::WARN, "first %d", i);
+      logger.log(LogLevel::WARN, "second %d", i);
+    }
+    logger.log(LogLevel::DEBUG, "below the level");
+  });
+
+  REQUIRE(count_containing(lines, "] first ") == LOG_RATE_BURST);
+  REQUIRE(count_containing(lines, "] second ") == LOG_RATE_BURST);
+  REQUIRE(count_containing(lines, "below the level") == 0);
+  // reported when the logger stops, nothing else was logged by the sites
+  REQUIRE(count_containing(lines, "30 similar messages suppressed: first") ==
+          1);
+  REQUIRE(count_containing(lines, "30 similar messages suppressed: second") ==
+          1);
+}
+
+TEST_CASE("logger counts lines dropped by a full ring", "[logger]") {
+  const int total = 20000;
+  auto lines = logged_lines(total, [&](Logger &logger) {
+    for (int i = 0; i < total; ++i) {
+      logger.log(LogLevel::INFO, "line %d", i);
+    }
+  });
+
+  size_t written = count_containing(lines, "] line ");
+  unsigned long long dropped = 0;
+  for (const auto &line : lines) {
+    unsigned long long count;
+    if (sscanf(line.c_str(), "[WARN] log ring full, %llu lines dropped",
+               &count) == 1) {
+      dropped += count;
+    }
+  }
+  REQUIRE(dropped > 0);
+  REQUIRE(written + dropped == total);
+}